@@ -0,0 +1,411 @@
+#pragma once
+#include "AtlasUtil/Annotate.h"
+#include "AtlasUtil/Exceptions.h"
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Module.h>
+#include <queue>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/// <summary>
+/// Lists of block IDs in compressed sparse row form. The list of row i is edges[offsets[i], offsets[i + 1]).
+/// </summary>
+class BlockEdges
+{
+public:
+    struct Range
+    {
+        const int64_t *first;
+        const int64_t *last;
+        const int64_t *begin() const
+        {
+            return first;
+        }
+        const int64_t *end() const
+        {
+            return last;
+        }
+        size_t size() const
+        {
+            return (size_t)(last - first);
+        }
+    };
+
+    Range operator[](size_t row) const
+    {
+        return {edges.data() + offsets[row], edges.data() + offsets[row + 1]};
+    }
+
+    /// <summary>
+    /// Appends the next row.
+    /// </summary>
+    void Add(const std::vector<int64_t> &row)
+    {
+        edges.insert(edges.end(), row.begin(), row.end());
+        offsets.push_back(edges.size());
+    }
+
+private:
+    std::vector<size_t> offsets = {0};
+    std::vector<int64_t> edges;
+};
+
+/// <summary>
+/// The control flow of an annotated module indexed by block ID, built once so that graph walks scan arrays instead of LLVM use lists and metadata.
+/// Besides the successors and predecessors of every block it holds the call edges to the entries of the called functions
+/// and the return edges from returning blocks to the blocks that call their function.
+/// The module must not change while the graph is in use.
+/// </summary>
+class BlockGraph
+{
+public:
+    BlockGraph() = default;
+    explicit BlockGraph(llvm::Module *M)
+    {
+        std::vector<const llvm::Function *> functions;
+        for (auto &F : *M)
+        {
+            if (F.empty())
+            {
+                continue;
+            }
+            for (auto &BB : F)
+            {
+                int64_t id = GetBlockID(&BB);
+                ids[&BB] = id;
+                if (id < 0)
+                {
+                    continue;
+                }
+                if ((size_t)id >= blocks.size())
+                {
+                    blocks.resize((size_t)id + 1, nullptr);
+                    blockFunction.resize((size_t)id + 1, 0);
+                }
+                blocks[(size_t)id] = &BB;
+                blockFunction[(size_t)id] = functions.size();
+            }
+            functionEntries.push_back(GetBlockID(&F.getEntryBlock()));
+            functions.push_back(&F);
+        }
+
+        std::vector<int64_t> row;
+        for (const auto *F : functions)
+        {
+            row.clear();
+            for (auto user : F->users())
+            {
+                if (auto *cb = llvm::dyn_cast<llvm::CallBase>(user))
+                {
+                    row.push_back(ID(cb->getParent()));
+                }
+            }
+            callSites.Add(row);
+        }
+
+        terminators.resize(blocks.size(), TerminatorOther);
+        for (size_t id = 0; id < blocks.size(); id++)
+        {
+            llvm::BasicBlock *BB = blocks[id];
+            row.clear();
+            if (BB != nullptr)
+            {
+                for (auto suc : llvm::successors(BB))
+                {
+                    row.push_back(ID(suc));
+                }
+            }
+            successors.Add(row);
+
+            row.clear();
+            if (BB != nullptr)
+            {
+                for (auto pred : llvm::predecessors(BB))
+                {
+                    row.push_back(ID(pred));
+                }
+            }
+            predecessors.Add(row);
+
+            row.clear();
+            if (BB != nullptr)
+            {
+                for (auto &inst : *BB)
+                {
+                    if (auto *cb = llvm::dyn_cast<llvm::CallBase>(&inst))
+                    {
+                        llvm::Function *f = cb->getCalledFunction();
+                        if (f != nullptr && !f->empty())
+                        {
+                            row.push_back(ID(&f->getEntryBlock()));
+                        }
+                    }
+                }
+            }
+            calls.Add(row);
+
+            row.clear();
+            if (BB != nullptr)
+            {
+                auto *term = BB->getTerminator();
+                if (llvm::isa<llvm::ReturnInst>(term))
+                {
+                    terminators[id] = TerminatorReturn;
+                }
+                else if (llvm::isa<llvm::ResumeInst>(term))
+                {
+                    terminators[id] = TerminatorResume;
+                }
+                if (terminators[id] != TerminatorOther)
+                {
+                    auto sites = callSites[blockFunction[id]];
+                    row.assign(sites.begin(), sites.end());
+                }
+            }
+            returns.Add(row);
+        }
+    }
+
+    /// <summary>
+    /// One past the largest block ID.
+    /// </summary>
+    size_t Size() const
+    {
+        return blocks.size();
+    }
+    llvm::BasicBlock *Block(int64_t id) const
+    {
+        return blocks.at((size_t)id);
+    }
+    /// <summary>
+    /// The ID of a block of the module, -1 if it has none.
+    /// </summary>
+    int64_t ID(const llvm::BasicBlock *block) const
+    {
+        auto entry = ids.find(block);
+        return entry == ids.end() ? -1 : entry->second;
+    }
+    BlockEdges::Range Successors(int64_t id) const
+    {
+        return successors[(size_t)id];
+    }
+    BlockEdges::Range Predecessors(int64_t id) const
+    {
+        return predecessors[(size_t)id];
+    }
+    /// <summary>
+    /// The entries of the functions called by the block, in the order of the calls.
+    /// </summary>
+    BlockEdges::Range Calls(int64_t id) const
+    {
+        return calls[(size_t)id];
+    }
+    /// <summary>
+    /// The blocks control returns to from a block ending in a return or resume.
+    /// </summary>
+    BlockEdges::Range Returns(int64_t id) const
+    {
+        return returns[(size_t)id];
+    }
+    /// <summary>
+    /// The blocks that call the function of the block.
+    /// </summary>
+    BlockEdges::Range Callers(int64_t id) const
+    {
+        return callSites[blockFunction[(size_t)id]];
+    }
+    /// <summary>
+    /// The entry block of the function of the block.
+    /// </summary>
+    int64_t FunctionEntry(int64_t id) const
+    {
+        return functionEntries[blockFunction[(size_t)id]];
+    }
+    bool IsEntry(int64_t id) const
+    {
+        return FunctionEntry(id) == id;
+    }
+    bool IsReturn(int64_t id) const
+    {
+        return terminators[(size_t)id] == TerminatorReturn;
+    }
+
+    /// <summary>
+    /// Checks whether target can be reached from base along successors, calls and returns without leaving validBlocks.
+    /// </summary>
+    bool IsReachable(int64_t base, int64_t target, const std::set<int64_t> &validBlocks) const
+    {
+        std::queue<int64_t> toProcess;
+        std::unordered_set<int64_t> checked;
+        toProcess.push(base);
+        checked.insert(base);
+        bool foundTarget = false;
+        auto visit = [&](int64_t next) {
+            if (next == target)
+            {
+                foundTarget = true;
+            }
+            else if (checked.find(next) == checked.end() && validBlocks.find(next) != validBlocks.end())
+            {
+                checked.insert(next);
+                toProcess.push(next);
+            }
+        };
+        while (!toProcess.empty() && !foundTarget)
+        {
+            int64_t block = toProcess.front();
+            toProcess.pop();
+            for (auto next : Successors(block))
+            {
+                visit(next);
+            }
+            for (auto next : Calls(block))
+            {
+                visit(next);
+            }
+            for (auto next : Returns(block))
+            {
+                visit(next);
+            }
+        }
+        return foundTarget;
+    }
+
+    bool IsSelfReachable(int64_t base, const std::set<int64_t> &validBlocks) const
+    {
+        return IsReachable(base, base, validBlocks);
+    }
+
+    /// <summary>
+    /// The blocks of validBlocks reachable from base along successors and calls. Base is part of the result only if it can reach itself.
+    /// </summary>
+    std::set<int64_t> GetReachable(int64_t base, const std::set<int64_t> &validBlocks) const
+    {
+        bool foundSelf = false;
+        std::queue<int64_t> toProcess;
+        std::set<int64_t> checked;
+        toProcess.push(base);
+        checked.insert(base);
+        auto visit = [&](int64_t next) {
+            if (next == base)
+            {
+                foundSelf = true;
+            }
+            if (checked.find(next) == checked.end() && validBlocks.find(next) != validBlocks.end())
+            {
+                checked.insert(next);
+                toProcess.push(next);
+            }
+        };
+        while (!toProcess.empty())
+        {
+            int64_t block = toProcess.front();
+            toProcess.pop();
+            for (auto next : Successors(block))
+            {
+                visit(next);
+            }
+            for (auto next : Calls(block))
+            {
+                visit(next);
+            }
+        }
+        if (!foundSelf)
+        {
+            checked.erase(base);
+        }
+        return checked;
+    }
+
+    /// <summary>
+    /// The blocks through which control can enter the given blocks, the same as the tik function of the same name.
+    /// </summary>
+    std::set<int64_t> GetEntrances(const std::set<int64_t> &blocks) const
+    {
+        std::set<int64_t> entrances;
+        for (auto block : blocks)
+        {
+            int64_t entry = FunctionEntry(block);
+            //an entry block can only be entered through a function call
+            if (block == entry)
+            {
+                bool exte = false;
+                bool inte = false;
+                for (auto caller : Callers(block))
+                {
+                    if (blocks.find(caller) == blocks.end())
+                    {
+                        exte = true;
+                    }
+                    else
+                    {
+                        inte = true;
+                    }
+                }
+                if (exte && !inte)
+                {
+                    //exclusively external so this is an entrance
+                    entrances.insert(block);
+                }
+                else if (!exte && !inte)
+                {
+                    throw AtlasException("Function with no internal or external uses");
+                }
+            }
+            else
+            {
+                //an entrance is reachable from the entry of its function without passing through the other blocks
+                //the walk takes the newest block but drops the oldest, like the tik version does
+                bool ent = false;
+                std::queue<int64_t> workingSet;
+                std::set<int64_t> visitedBlocks;
+                workingSet.push(block);
+                visitedBlocks.insert(block);
+                while (!workingSet.empty())
+                {
+                    int64_t current = workingSet.back();
+                    workingSet.pop();
+                    if (current == entry)
+                    {
+                        ent = true;
+                        break;
+                    }
+                    for (auto pred : Predecessors(current))
+                    {
+                        if (visitedBlocks.find(pred) == visitedBlocks.end() && blocks.find(pred) == blocks.end())
+                        {
+                            visitedBlocks.insert(pred);
+                            workingSet.push(pred);
+                        }
+                    }
+                }
+                if (ent)
+                {
+                    entrances.insert(block);
+                }
+            }
+        }
+        return entrances;
+    }
+
+private:
+    enum Terminator : uint8_t
+    {
+        TerminatorOther,
+        TerminatorReturn,
+        TerminatorResume
+    };
+    std::vector<llvm::BasicBlock *> blocks;
+    std::vector<size_t> blockFunction;
+    std::vector<Terminator> terminators;
+    std::vector<int64_t> functionEntries;
+    std::unordered_map<const llvm::BasicBlock *, int64_t> ids;
+    BlockEdges successors;
+    BlockEdges predecessors;
+    BlockEdges calls;
+    BlockEdges returns;
+    BlockEdges callSites;
+};
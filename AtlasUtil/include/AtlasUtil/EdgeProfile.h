@@ -0,0 +1,193 @@
+#pragma once
+#include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/TraceFormat.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <numeric>
+#include <string>
+#include <vector>
+
+/// <summary>
+/// The virtual exit node of a function's flow graph. Every block without successors has an edge to it and it has an edge back to the entry block,
+/// so flow is conserved at every node and the count of that back edge is the number of calls.
+/// </summary>
+#define EDGE_PROFILE_EXIT -1
+
+/// <summary>
+/// A control flow edge between two block IDs. Only edges off the spanning tree have a counter, the others are recovered from flow conservation.
+/// </summary>
+struct ProfileEdge
+{
+    int64_t source;
+    int64_t target;
+    int64_t counter = -1;
+    uint64_t count = 0;
+};
+
+static int64_t FindRoot(std::map<int64_t, int64_t> &parents, int64_t node)
+{
+    parents.emplace(node, node);
+    int64_t root = node;
+    while (parents[root] != root)
+    {
+        root = parents[root];
+    }
+    while (parents[node] != root)
+    {
+        int64_t next = parents[node];
+        parents[node] = root;
+        node = next;
+    }
+    return root;
+}
+
+/// <summary>
+/// Chooses the spanning tree of a function's flow graph, ignoring edge direction.
+/// Edges are taken by decreasing weight, so the counters end up on the coldest edges. Edges of weight UINT64_MAX cannot be counted and must be in the tree.
+/// </summary>
+/// <param name="edges">The edges of the flow graph.</param>
+/// <param name="weights">The estimated execution frequency of every edge.</param>
+/// <returns>For every edge whether it is in the tree. Empty if the uncountable edges form a cycle.</returns>
+static std::vector<bool> SpanningTree(const std::vector<ProfileEdge> &edges, const std::vector<uint64_t> &weights)
+{
+    std::vector<size_t> order(edges.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return weights[a] > weights[b]; });
+
+    std::map<int64_t, int64_t> parents;
+    std::vector<bool> tree(edges.size(), false);
+    for (auto i : order)
+    {
+        int64_t sourceRoot = FindRoot(parents, edges[i].source);
+        int64_t targetRoot = FindRoot(parents, edges[i].target);
+        if (sourceRoot != targetRoot)
+        {
+            parents[sourceRoot] = targetRoot;
+            tree[i] = true;
+        }
+        else if (weights[i] == UINT64_MAX)
+        {
+            return std::vector<bool>();
+        }
+    }
+    return tree;
+}
+
+/// <summary>
+/// Recovers the count of every edge of a function. Counted edges are read from the counters, the others are solved leaf first:
+/// a node with a single unknown edge gets that edge's count from the difference between its inflow and outflow.
+/// </summary>
+/// <returns>True if every edge was recovered.</returns>
+static bool SolveEdgeCounts(std::vector<ProfileEdge> &edges, const std::vector<uint64_t> &counters)
+{
+    std::vector<bool> known(edges.size(), false);
+    std::map<int64_t, std::vector<size_t>> incident;
+    for (size_t i = 0; i < edges.size(); i++)
+    {
+        auto &edge = edges[i];
+        if (edge.counter >= 0)
+        {
+            if ((uint64_t)edge.counter >= counters.size())
+            {
+                throw AtlasException("Edge counter out of range: " + std::to_string(edge.counter));
+            }
+            edge.count = counters[(uint64_t)edge.counter];
+            known[i] = true;
+        }
+        incident[edge.source].push_back(i);
+        if (edge.target != edge.source)
+        {
+            incident[edge.target].push_back(i);
+        }
+    }
+
+    bool change = true;
+    while (change)
+    {
+        change = false;
+        for (auto &[node, nodeEdges] : incident)
+        {
+            int64_t inflow = 0;
+            int64_t outflow = 0;
+            size_t unknown = edges.size();
+            size_t unknownCount = 0;
+            for (auto i : nodeEdges)
+            {
+                if (!known[i])
+                {
+                    unknown = i;
+                    unknownCount++;
+                    continue;
+                }
+                if (edges[i].source == edges[i].target)
+                {
+                    continue;
+                }
+                if (edges[i].target == node)
+                {
+                    inflow += (int64_t)edges[i].count;
+                }
+                else
+                {
+                    outflow += (int64_t)edges[i].count;
+                }
+            }
+            if (unknownCount != 1)
+            {
+                continue;
+            }
+            int64_t count = edges[unknown].target == node ? outflow - inflow : inflow - outflow;
+            edges[unknown].count = count < 0 ? 0 : (uint64_t)count;
+            known[unknown] = true;
+            change = true;
+        }
+    }
+    return std::all_of(known.begin(), known.end(), [](bool k) { return k; });
+}
+
+/// <summary>
+/// The execution count of every block, the sum of its incoming edges.
+/// </summary>
+static std::map<int64_t, uint64_t> EdgeBlockCounts(const std::vector<ProfileEdge> &edges)
+{
+    std::map<int64_t, uint64_t> counts;
+    for (const auto &edge : edges)
+    {
+        if (edge.target != EDGE_PROFILE_EXIT)
+        {
+            counts[edge.target] += edge.count;
+        }
+    }
+    return counts;
+}
+
+/// <summary>
+/// Reads the counters written by a binary instrumented with the EdgeProfile pass.
+/// The file is the EDGE_PROFILE_MAGIC header, the number of counters and then the counters, all native uint64_t.
+/// </summary>
+static std::vector<uint64_t> ReadEdgeProfile(const std::string &ProfileFile)
+{
+    std::ifstream inputProfile(ProfileFile, std::ios::binary);
+    if (!inputProfile)
+    {
+        throw AtlasException("Failed to open edge profile: " + ProfileFile);
+    }
+    char header[EDGE_PROFILE_HEADER_SIZE];
+    uint64_t size = 0;
+    inputProfile.read(header, EDGE_PROFILE_HEADER_SIZE);
+    inputProfile.read((char *)&size, sizeof(size));
+    if (!inputProfile || memcmp(header, EDGE_PROFILE_MAGIC, strlen(EDGE_PROFILE_MAGIC)) != 0)
+    {
+        throw AtlasException("Not an edge profile: " + ProfileFile);
+    }
+    std::vector<uint64_t> counters(size);
+    inputProfile.read((char *)counters.data(), (std::streamsize)(size * sizeof(uint64_t)));
+    if (!inputProfile)
+    {
+        throw AtlasException("Truncated edge profile: " + ProfileFile);
+    }
+    return counters;
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Calls body for every index below count on a pool of threads. A thread takes the next index as soon as it is done with one,
+/// so items of uneven cost balance out. The first exception of a body is rethrown once every thread is done.
+/// </summary>
+static void ParallelFor(size_t count, const std::function<void(size_t)> &body, unsigned int threads = std::thread::hardware_concurrency())
+{
+    threads = (unsigned int)std::max((size_t)1, std::min((size_t)threads, count));
+    if (threads == 1)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next(0);
+    std::mutex lock;
+    std::exception_ptr failure;
+    auto work = [&]() {
+        for (size_t i = next++; i < count; i = next++)
+        {
+            try
+            {
+                body(i);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (!failure)
+                {
+                    failure = std::current_exception();
+                }
+                // the remaining items are skipped
+                next = count;
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (unsigned int i = 1; i < threads; i++)
+    {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto &thread : pool)
+    {
+        thread.join();
+    }
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include "AtlasUtil/Exceptions.h"
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+
+/// <summary>
+/// Reads a block profile written by a binary instrumented in count mode. Every line is "block,count".
+/// </summary>
+static std::map<int64_t, uint64_t> ReadBlockProfile(const std::string &ProfileFile)
+{
+    std::ifstream inputProfile(ProfileFile);
+    if (!inputProfile)
+    {
+        throw AtlasException("Failed to open profile file: " + ProfileFile);
+    }
+    std::map<int64_t, uint64_t> counts;
+    std::string line;
+    while (std::getline(inputProfile, line))
+    {
+        auto comma = line.find(',');
+        if (comma == std::string::npos)
+        {
+            continue;
+        }
+        counts[std::stoll(line.substr(0, comma))] += std::stoull(line.substr(comma + 1));
+    }
+    return counts;
+}
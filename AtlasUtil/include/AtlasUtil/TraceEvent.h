@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/// <summary>
+/// The kinds of events a trace consumer is handed.
+/// </summary>
+enum class TraceOp
+{
+    TraceVersion,
+    BBEnter,
+    BBExit,
+    LoadAddress,
+    StoreAddress,
+    LoadValue,
+    StoreValue,
+    KernelEnter,
+    KernelExit,
+    Sequence,
+    Skip,
+    /// <summary>
+    /// Passed on by the merge when the events switch to the file of another thread.
+    /// </summary>
+    Thread,
+    /// <summary>
+    /// Any other text record, e.g. written by the Write functions of the backend.
+    /// </summary>
+    Other
+};
+
+/// <summary>
+/// A decoded trace event. The views point into the buffers of the reader and are only valid until the next event.
+/// </summary>
+struct TraceEvent
+{
+    TraceOp op = TraceOp::Other;
+    /// <summary>
+    /// The block ID, address, sequence number, skipped block count, thread index or trace version.
+    /// </summary>
+    uint64_t number = 0;
+    /// <summary>
+    /// The raw bytes of a value, the kernel label or the whole rest of the line after the key of other records, null if that line has no colon.
+    /// </summary>
+    std::string_view data;
+    /// <summary>
+    /// The key of other records.
+    /// </summary>
+    std::string_view key;
+};
+
+/// <summary>
+/// The key of an event in the text encoding.
+/// </summary>
+static std::string_view TraceOpName(TraceOp op)
+{
+    static const std::string_view names[] = {"TraceVersion", "BBEnter", "BBExit", "LoadAddress", "StoreAddress", "LoadValue", "StoreValue", "KernelEnter", "KernelExit", "Sequence", "Skip", "Thread", ""};
+    return names[(size_t)op];
+}
+
+/// <summary>
+/// The text line an other record was read from, its key and the rest of the line.
+/// </summary>
+static std::string TraceOtherLine(const TraceEvent &event)
+{
+    std::string line(event.key);
+    if (event.data.data() != nullptr)
+    {
+        line += ':';
+        line.append(event.data);
+    }
+    return line;
+}
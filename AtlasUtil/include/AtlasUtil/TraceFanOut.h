@@ -0,0 +1,369 @@
+#pragma once
+#include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/TraceEvent.h"
+#include "AtlasUtil/Traces.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <indicators/progress_bar.hpp>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// <summary>
+/// The most events a batch of the fan-out holds.
+/// </summary>
+#define TRACE_BATCH_EVENTS 4096
+
+/// <summary>
+/// The initial size of the buffer holding the values and labels of a batch.
+/// </summary>
+#define TRACE_BATCH_BYTES (64 * 1024)
+
+/// <summary>
+/// The number of batches in flight between the decoder and the threaded consumers.
+/// </summary>
+#define TRACE_BATCH_SLOTS 8
+
+/// <summary>
+/// A batch of decoded events. The views of the events point into data, which the batch owns.
+/// </summary>
+struct TraceBatch
+{
+    std::vector<TraceEvent> events;
+    std::string data;
+
+    /// <summary>
+    /// Copies an event into the batch. Returns false if the batch is full.
+    /// </summary>
+    bool Add(const TraceEvent &event)
+    {
+        // the keys of known events are static, only those of other records point into the reader
+        size_t need = event.data.size() + (event.op == TraceOp::Other ? event.key.size() : 0);
+        if (events.size() == TRACE_BATCH_EVENTS)
+        {
+            return false;
+        }
+        if (data.size() + need > data.capacity())
+        {
+            // growing the buffer would move the data the events already point to
+            if (!events.empty())
+            {
+                return false;
+            }
+            data.reserve(std::max(need, (size_t)TRACE_BATCH_BYTES));
+        }
+        TraceEvent &copy = events.emplace_back(event);
+        // a null value marks an other line without a colon
+        copy.data = event.data.data() == nullptr ? std::string_view() : std::string_view(data.data() + data.size(), event.data.size());
+        data.append(event.data);
+        if (event.op == TraceOp::Other)
+        {
+            copy.key = std::string_view(data.data() + data.size(), event.key.size());
+            data.append(event.key);
+        }
+        return true;
+    }
+
+    void Clear()
+    {
+        events.clear();
+        data.clear();
+    }
+};
+
+/// <summary>
+/// A consumer of the fan-out. Consumers that share no state with the others can run on their own thread.
+/// </summary>
+struct TraceConsumer
+{
+    std::function<void(const TraceEvent &)> function;
+    bool threaded = false;
+};
+
+/// <summary>
+/// Decodes a trace once and feeds its events to every consumer.
+/// Consumers that are not threaded are called by the decoding thread as the events arrive, the threaded ones each get their own thread
+/// and are handed the events in batches. An exception of a consumer is rethrown once the trace is done.
+/// </summary>
+static void FanOutTrace(const std::string &TraceFile, const std::vector<TraceConsumer> &consumers, const std::string &barPrefix = "", bool noBar = false)
+{
+    std::vector<const TraceConsumer *> inlineConsumers;
+    std::vector<const TraceConsumer *> threadedConsumers;
+    for (const auto &consumer : consumers)
+    {
+        (consumer.threaded ? threadedConsumers : inlineConsumers).push_back(&consumer);
+    }
+
+    std::vector<TraceBatch> slots(TRACE_BATCH_SLOTS);
+    std::vector<size_t> pending(TRACE_BATCH_SLOTS, 0);
+    std::mutex lock;
+    std::condition_variable change;
+    uint64_t published = 0;
+    bool done = false;
+    std::exception_ptr failure;
+
+    std::vector<std::thread> workers;
+    for (const auto *consumer : threadedConsumers)
+    {
+        workers.emplace_back([&, consumer]() {
+            bool failed = false;
+            for (uint64_t n = 0;; n++)
+            {
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    change.wait(guard, [&]() { return published > n || done; });
+                    if (published <= n)
+                    {
+                        break;
+                    }
+                }
+                // a failed consumer keeps releasing its batches so the decoder is not blocked
+                if (!failed)
+                {
+                    try
+                    {
+                        for (const auto &event : slots[n % TRACE_BATCH_SLOTS].events)
+                        {
+                            consumer->function(event);
+                        }
+                    }
+                    catch (...)
+                    {
+                        failed = true;
+                        std::lock_guard<std::mutex> guard(lock);
+                        if (!failure)
+                        {
+                            failure = std::current_exception();
+                        }
+                    }
+                }
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    pending[n % TRACE_BATCH_SLOTS]--;
+                }
+                change.notify_all();
+            }
+        });
+    }
+
+    uint64_t current = 0;
+    auto publish = [&]() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending[current % TRACE_BATCH_SLOTS] = threadedConsumers.size();
+            published = current + 1;
+        }
+        change.notify_all();
+        current++;
+        // wait until every consumer is done with the batch that was in this slot before
+        std::unique_lock<std::mutex> guard(lock);
+        change.wait(guard, [&]() { return pending[current % TRACE_BATCH_SLOTS] == 0; });
+        slots[current % TRACE_BATCH_SLOTS].Clear();
+    };
+    auto finish = [&]() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+        }
+        change.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    };
+
+    try
+    {
+        ProcessTrace(
+            TraceFile, [&](const TraceEvent &event) {
+                for (const auto *consumer : inlineConsumers)
+                {
+                    consumer->function(event);
+                }
+                if (!workers.empty() && !slots[current % TRACE_BATCH_SLOTS].Add(event))
+                {
+                    publish();
+                    slots[current % TRACE_BATCH_SLOTS].Add(event);
+                }
+            },
+            barPrefix, noBar);
+        if (!workers.empty() && !slots[current % TRACE_BATCH_SLOTS].events.empty())
+        {
+            publish();
+        }
+    }
+    catch (...)
+    {
+        finish();
+        throw;
+    }
+    finish();
+    if (failure)
+    {
+        std::rethrow_exception(failure);
+    }
+}
+
+/// <summary>
+/// A compact copy of some of the events of a trace, so that later passes replay them at memory speed instead of decoding the trace again.
+/// Every event is a single uint64_t, the opcode in the low 4 bits and the number above them. Values are dropped, kernel labels are kept
+/// in a table and their events hold the index. The records are written to an anonymous temporary file, so the cache is not limited by memory.
+/// </summary>
+class TraceCache
+{
+public:
+    /// <summary>
+    /// Creates a cache of the given kinds of events.
+    /// </summary>
+    TraceCache(std::initializer_list<TraceOp> ops)
+    {
+        for (auto op : ops)
+        {
+            keep[(size_t)op] = true;
+        }
+        buffer.reserve(TRACE_READ_SIZE / sizeof(uint64_t));
+    }
+    TraceCache(const TraceCache &) = delete;
+    TraceCache &operator=(const TraceCache &) = delete;
+    ~TraceCache()
+    {
+        if (file != nullptr)
+        {
+            fclose(file);
+        }
+    }
+
+    /// <summary>
+    /// Appends an event to the cache if it is one of the kept kinds.
+    /// </summary>
+    void Add(const TraceEvent &event)
+    {
+        if (!keep[(size_t)event.op])
+        {
+            return;
+        }
+        uint64_t number = event.number;
+        if (event.op == TraceOp::KernelEnter || event.op == TraceOp::KernelExit)
+        {
+            auto [entry, added] = labelIndex.try_emplace(std::string(event.data), labels.size());
+            if (added)
+            {
+                labels.emplace_back(event.data);
+            }
+            number = entry->second;
+        }
+        buffer.push_back((number << 4) | (uint64_t)event.op);
+        if (buffer.size() == buffer.capacity())
+        {
+            Flush();
+        }
+    }
+
+    /// <summary>
+    /// The fan-out consumer that fills the cache. It only touches the cache, so it runs on its own thread.
+    /// </summary>
+    TraceConsumer Consumer()
+    {
+        return {[this](const TraceEvent &event) { Add(event); }, true};
+    }
+
+    /// <summary>
+    /// Feeds the cached events to the logic function, in the order of the trace.
+    /// </summary>
+    void Replay(const std::function<void(const TraceEvent &)> &LogicFunction, const std::string &barPrefix = "", bool noBar = false)
+    {
+        Flush();
+        std::cout << "\e[?25l";
+        indicators::ProgressBar bar;
+        if (!noBar)
+        {
+            bar.set_option(indicators::option::PrefixText{barPrefix});
+            bar.set_option(indicators::option::ShowElapsedTime{true});
+            bar.set_option(indicators::option::ShowRemainingTime{true});
+            bar.set_option(indicators::option::BarWidth{50});
+        }
+
+        if (file != nullptr)
+        {
+            rewind(file);
+        }
+        TraceEvent event;
+        uint64_t replayed = 0;
+        while (replayed < records)
+        {
+            buffer.resize(buffer.capacity());
+            size_t read = fread(buffer.data(), sizeof(uint64_t), buffer.size(), file);
+            if (read == 0)
+            {
+                throw AtlasException("Failed to read the trace cache");
+            }
+            for (size_t i = 0; i < read; i++)
+            {
+                event.op = (TraceOp)(buffer[i] & 0xF);
+                event.number = buffer[i] >> 4;
+                event.key = TraceOpName(event.op);
+                event.data = std::string_view();
+                if (event.op == TraceOp::KernelEnter || event.op == TraceOp::KernelExit)
+                {
+                    event.data = labels[event.number];
+                    event.number = 0;
+                }
+                LogicFunction(event);
+            }
+            replayed += read;
+            if (!noBar)
+            {
+                bar.set_progress((float)replayed / (float)records * 100.0f);
+                bar.set_option(indicators::option::PostfixText{"Event " + std::to_string(replayed) + "/" + std::to_string(records)});
+            }
+        }
+        buffer.clear();
+        if (file != nullptr)
+        {
+            // further records are appended
+            fseek(file, 0, SEEK_END);
+        }
+
+        if (!noBar && !bar.is_completed())
+        {
+            bar.mark_as_completed();
+        }
+        std::cout << "\e[?25h";
+    }
+
+private:
+    bool keep[(size_t)TraceOp::Other + 1] = {};
+    FILE *file = nullptr;
+    std::vector<uint64_t> buffer;
+    uint64_t records = 0;
+    std::vector<std::string> labels;
+    std::unordered_map<std::string, uint64_t> labelIndex;
+
+    void Flush()
+    {
+        if (buffer.empty())
+        {
+            return;
+        }
+        if (file == nullptr)
+        {
+            file = tmpfile();
+            if (file == nullptr)
+            {
+                throw AtlasException("Failed to create the trace cache");
+            }
+        }
+        if (fwrite(buffer.data(), sizeof(uint64_t), buffer.size(), file) != buffer.size())
+        {
+            throw AtlasException("Failed to write the trace cache");
+        }
+        records += buffer.size();
+        buffer.clear();
+    }
+};
@@ -0,0 +1,98 @@
+#pragma once
+#include <stdint.h>
+
+/// <summary>
+/// Trace version of the legacy text encoding. Every event is a "key:value\n" line.
+/// </summary>
+#define TRACE_VERSION_TEXT 3
+
+/// <summary>
+/// Trace version of the binary encoding. Every event is a one byte opcode followed by its payload.
+/// </summary>
+#define TRACE_VERSION_BINARY 4
+
+/// <summary>
+/// Every trace file starts with these magic bytes, followed by the codec byte, the flags byte and the run ID up to TRACE_HEADER_SIZE.
+/// The rest of the file is compressed with the codec. Files without the magic are zlib streams written before codecs existed.
+/// </summary>
+#define TRACE_MAGIC "ATRC"
+#define TRACE_HEADER_SIZE 8
+
+/// <summary>
+/// Offset of the run ID in the header, a little endian uint16_t shared by the files of the threads of one run. Zero if unknown.
+/// </summary>
+#define TRACE_RUN_OFFSET 6
+
+/// <summary>
+/// Flags, stored in the header byte after the codec.
+/// A framed trace is a series of independently compressed frames followed by the frame index and the index trailer.
+/// </summary>
+#define TRACE_FLAG_FRAMED 1
+
+/// <summary>
+/// An entry of the frame index. Frames are cut at record boundaries and every frame but the first starts with a frame record.
+/// Offset and size locate the compressed frame in the file, rawSize is its decompressed size.
+/// The blocks are the first and last block ID of the frame, UINT64_MAX if it has no block records.
+/// </summary>
+typedef struct TraceFrame
+{
+    uint64_t offset;
+    uint64_t size;
+    uint64_t rawSize;
+    uint64_t records;
+    uint64_t firstBlock;
+    uint64_t lastBlock;
+} TraceFrame;
+
+/// <summary>
+/// The trailer ends a framed trace: the number of frames as a uint64_t, then these magic bytes padded up to TRACE_TRAILER_SIZE.
+/// The index is right in front of it. A trace without a valid trailer, e.g. of a program that crashed, can still be read front to back.
+/// </summary>
+#define TRACE_INDEX_MAGIC "ATRI"
+#define TRACE_TRAILER_SIZE 16
+
+/// <summary>
+/// Compression codecs of the trace files.
+/// </summary>
+enum TraceCodec
+{
+    TraceCodecNone = 0,
+    TraceCodecZlib = 1,
+    TraceCodecZstd = 2,
+    TraceCodecLz4 = 3
+};
+
+/// <summary>
+/// The largest fixed size binary record. Only value, label and text records can exceed it.
+/// </summary>
+#define TRACE_MAX_RECORD 16
+
+/// <summary>
+/// Opcodes of the binary trace records.
+/// Block IDs and addresses are zigzag varint deltas from the previous record of the same kind.
+/// Values, labels and text are a varint length followed by the raw bytes.
+/// A sequence record carries a plain varint, the global sequence number of the records that follow it.
+/// A skip record carries a plain varint, the number of blocks a sampled trace left out before it.
+/// A frame record carries a plain varint, the number of the frame it starts, and resets the delta bases.
+/// </summary>
+enum TraceOpcode
+{
+    TraceOpBBEnter = 1,
+    TraceOpBBExit = 2,
+    TraceOpLoadAddress = 3,
+    TraceOpStoreAddress = 4,
+    TraceOpLoadValue = 5,
+    TraceOpStoreValue = 6,
+    TraceOpKernelEnter = 7,
+    TraceOpKernelExit = 8,
+    TraceOpText = 9,
+    TraceOpSequence = 10,
+    TraceOpSkip = 11,
+    TraceOpFrame = 12
+};
+
+/// <summary>
+/// Edge profiles start with these magic bytes, padded up to EDGE_PROFILE_HEADER_SIZE, followed by the uint64_t counter count and the counters.
+/// </summary>
+#define EDGE_PROFILE_MAGIC "AEPF"
+#define EDGE_PROFILE_HEADER_SIZE 8
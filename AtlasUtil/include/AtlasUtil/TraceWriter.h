@@ -0,0 +1,293 @@
+#pragma once
+#include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/TraceEvent.h"
+#include "AtlasUtil/TraceFormat.h"
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#ifdef ATLAS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ATLAS_LZ4
+#include <lz4frame.h>
+#endif
+
+/// <summary>
+/// Writes events as a framed binary trace, the same format the backend writes. Used by tools that produce traces from other traces.
+/// Every frame is collected in memory and compressed at once when it is full.
+/// </summary>
+class TraceWriter
+{
+public:
+    /// <summary>
+    /// The number of records written so far and the size of the file.
+    /// </summary>
+    uint64_t records = 0;
+    uint64_t written = 0;
+    /// <summary>
+    /// The index entries of the frames written so far.
+    /// </summary>
+    std::vector<TraceFrame> frames;
+
+    /// <summary>
+    /// Creates the trace file. Run is the run ID of the header, the files of the threads of one trace share it.
+    /// </summary>
+    TraceWriter(const std::string &TraceFile, int codec, int level, uint64_t frameSize, uint16_t run = 0) : codec(codec), level(level), frameSize(frameSize)
+    {
+        switch (codec)
+        {
+            case TraceCodecNone:
+            case TraceCodecZlib:
+#ifdef ATLAS_ZSTD
+            case TraceCodecZstd:
+#endif
+#ifdef ATLAS_LZ4
+            case TraceCodecLz4:
+#endif
+                break;
+            default:
+                throw AtlasException("Codec " + std::to_string(codec) + " is not supported by this build");
+        }
+        output.open(TraceFile, std::ios::binary | std::ios::trunc);
+        if (!output)
+        {
+            throw AtlasException("Failed to open trace file: " + TraceFile);
+        }
+        char header[TRACE_HEADER_SIZE] = {0};
+        memcpy(header, TRACE_MAGIC, strlen(TRACE_MAGIC));
+        header[strlen(TRACE_MAGIC)] = (char)codec;
+        header[strlen(TRACE_MAGIC) + 1] = TRACE_FLAG_FRAMED;
+        header[TRACE_RUN_OFFSET] = (char)(uint8_t)run;
+        header[TRACE_RUN_OFFSET + 1] = (char)(uint8_t)(run >> 8);
+        WriteOutput(header, TRACE_HEADER_SIZE);
+        frame = "TraceVersion:" + std::to_string(TRACE_VERSION_BINARY) + "\n";
+        StartFrame();
+    }
+    TraceWriter(const TraceWriter &) = delete;
+    TraceWriter &operator=(const TraceWriter &) = delete;
+    ~TraceWriter()
+    {
+        if (!closed)
+        {
+            try
+            {
+                Close();
+            }
+            catch (AtlasException &)
+            {
+            }
+        }
+    }
+
+    /// <summary>
+    /// Appends an event. Version events are dropped, the writer starts the trace with its own.
+    /// </summary>
+    void Write(const TraceEvent &event)
+    {
+        if (event.op == TraceOp::TraceVersion || event.op == TraceOp::Thread)
+        {
+            return;
+        }
+        if (frameRecords == 0 && !frames.empty())
+        {
+            // every frame but the first starts over with a frame record
+            frame.push_back((char)TraceOpFrame);
+            WriteVarint(frames.size());
+        }
+        switch (event.op)
+        {
+            case TraceOp::BBEnter:
+            case TraceOp::BBExit:
+                frame.push_back((char)(event.op == TraceOp::BBEnter ? TraceOpBBEnter : TraceOpBBExit));
+                WriteDelta(event.number, previousBlock);
+                if (firstBlock == UINT64_MAX)
+                {
+                    firstBlock = event.number;
+                }
+                break;
+            case TraceOp::LoadAddress:
+                frame.push_back((char)TraceOpLoadAddress);
+                WriteDelta(event.number, previousLoad);
+                break;
+            case TraceOp::StoreAddress:
+                frame.push_back((char)TraceOpStoreAddress);
+                WriteDelta(event.number, previousStore);
+                break;
+            case TraceOp::LoadValue:
+                WriteBytes(TraceOpLoadValue, event.data);
+                break;
+            case TraceOp::StoreValue:
+                WriteBytes(TraceOpStoreValue, event.data);
+                break;
+            case TraceOp::KernelEnter:
+                WriteBytes(TraceOpKernelEnter, event.data);
+                break;
+            case TraceOp::KernelExit:
+                WriteBytes(TraceOpKernelExit, event.data);
+                break;
+            case TraceOp::Sequence:
+                frame.push_back((char)TraceOpSequence);
+                WriteVarint(event.number);
+                break;
+            case TraceOp::Skip:
+                frame.push_back((char)TraceOpSkip);
+                WriteVarint(event.number);
+                break;
+            default:
+                WriteBytes(TraceOpText, TraceOtherLine(event));
+                break;
+        }
+        frameRecords++;
+        records++;
+        if (frame.size() >= frameSize)
+        {
+            EndFrame();
+        }
+    }
+
+    /// <summary>
+    /// Writes the last frame, the frame index and the trailer.
+    /// </summary>
+    void Close()
+    {
+        closed = true;
+        if (frameRecords != 0 || frames.empty())
+        {
+            EndFrame();
+        }
+        WriteOutput((const char *)frames.data(), frames.size() * sizeof(TraceFrame));
+        char trailer[TRACE_TRAILER_SIZE] = {0};
+        uint64_t count = frames.size();
+        memcpy(trailer, &count, sizeof(count));
+        memcpy(trailer + sizeof(count), TRACE_INDEX_MAGIC, strlen(TRACE_INDEX_MAGIC));
+        WriteOutput(trailer, TRACE_TRAILER_SIZE);
+        output.close();
+        if (!output)
+        {
+            throw AtlasException("Failed to write trace file");
+        }
+    }
+
+private:
+    std::ofstream output;
+    int codec;
+    int level;
+    uint64_t frameSize;
+    bool closed = false;
+    /// <summary>
+    /// The uncompressed records of the current frame.
+    /// </summary>
+    std::string frame;
+    std::string compressed;
+    uint64_t frameRecords = 0;
+    uint64_t firstBlock = UINT64_MAX;
+    uint64_t previousBlock = 0;
+    uint64_t previousLoad = 0;
+    uint64_t previousStore = 0;
+
+    void WriteOutput(const char *data, size_t size)
+    {
+        output.write(data, (std::streamsize)size);
+        written += size;
+    }
+
+    void WriteVarint(uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            frame.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        frame.push_back((char)value);
+    }
+
+    void WriteDelta(uint64_t current, uint64_t &previous)
+    {
+        auto delta = (int64_t)(current - previous);
+        WriteVarint(((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        previous = current;
+    }
+
+    void WriteBytes(uint8_t op, std::string_view data)
+    {
+        frame.push_back((char)op);
+        WriteVarint(data.size());
+        frame.append(data);
+    }
+
+    void StartFrame()
+    {
+        frameRecords = 0;
+        firstBlock = UINT64_MAX;
+        previousBlock = 0;
+        previousLoad = 0;
+        previousStore = 0;
+    }
+
+    /// <summary>
+    /// Compresses the current frame on its own and adds it to the index.
+    /// </summary>
+    void EndFrame()
+    {
+        switch (codec)
+        {
+            case TraceCodecZlib:
+            {
+                auto size = compressBound((uLong)frame.size());
+                compressed.resize(size);
+                if (compress2((Bytef *)compressed.data(), &size, (const Bytef *)frame.data(), (uLong)frame.size(), level) != Z_OK)
+                {
+                    throw AtlasException("Failed to compress trace frame");
+                }
+                compressed.resize(size);
+                break;
+            }
+#ifdef ATLAS_ZSTD
+            case TraceCodecZstd:
+            {
+                compressed.resize(ZSTD_compressBound(frame.size()));
+                size_t size = ZSTD_compress(compressed.data(), compressed.size(), frame.data(), frame.size(), level);
+                if (ZSTD_isError(size))
+                {
+                    throw AtlasException(std::string("Failed to compress trace frame: ") + ZSTD_getErrorName(size));
+                }
+                compressed.resize(size);
+                break;
+            }
+#endif
+#ifdef ATLAS_LZ4
+            case TraceCodecLz4:
+            {
+                LZ4F_preferences_t preferences;
+                memset(&preferences, 0, sizeof(preferences));
+                preferences.frameInfo.blockSizeID = LZ4F_max64KB;
+                preferences.compressionLevel = level;
+                compressed.resize(LZ4F_compressFrameBound(frame.size(), &preferences));
+                size_t size = LZ4F_compressFrame(compressed.data(), compressed.size(), frame.data(), frame.size(), &preferences);
+                if (LZ4F_isError(size))
+                {
+                    throw AtlasException(std::string("Failed to compress trace frame: ") + LZ4F_getErrorName(size));
+                }
+                compressed.resize(size);
+                break;
+            }
+#endif
+            default:
+                compressed = frame;
+                break;
+        }
+        TraceFrame entry;
+        entry.offset = written;
+        entry.size = compressed.size();
+        entry.rawSize = frame.size();
+        entry.records = frameRecords;
+        entry.firstBlock = firstBlock;
+        entry.lastBlock = firstBlock == UINT64_MAX ? UINT64_MAX : previousBlock;
+        frames.push_back(entry);
+        WriteOutput(compressed.data(), compressed.size());
+        frame.clear();
+        StartFrame();
+    }
+};
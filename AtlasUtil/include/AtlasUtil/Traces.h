@@ -1,140 +1,1175 @@
 #pragma once
 #include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/TraceEvent.h"
+#include "AtlasUtil/TraceFormat.h"
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <indicators/progress_bar.hpp>
+#include <memory>
+#include <mutex>
 #include <spdlog/spdlog.h>
-#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
 #include <zlib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef ATLAS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ATLAS_LZ4
+#include <lz4frame.h>
+#endif
 
+/// <summary>
+/// Progress is reported in blocks of this many bytes of the trace file.
+/// </summary>
 #define BLOCK_SIZE 4096
 
-static void ProcessTrace(const std::string &TraceFile, const std::function<void(std::string &, std::string &)> &LogicFunction, const std::string &barPrefix = "", bool noBar = false)
+/// <summary>
+/// The number of bytes the reader decompresses at once.
+/// </summary>
+#define TRACE_READ_SIZE (1024 * 1024)
+
+/// <summary>
+/// Running state of the binary decoder. Deltas are relative to the previous record of the same kind.
+/// </summary>
+struct TraceDecodeState
 {
-    std::cout << "\e[?25l";
-    indicators::ProgressBar bar;
-    int previousCount = 0;
-    if (!noBar)
+    uint64_t previousBlock = 0;
+    uint64_t previousLoad = 0;
+    uint64_t previousStore = 0;
+};
+
+/// <summary>
+/// Reads a LEB128 varint. Returns false if the buffer ends before the varint does.
+/// </summary>
+static bool ReadVarint(const char *&cursor, const char *end, uint64_t &result)
+{
+    result = 0;
+    for (int shift = 0; cursor < end && shift < 64; shift += 7)
     {
-        bar.set_option(indicators::option::PrefixText{barPrefix});
-        bar.set_option(indicators::option::ShowElapsedTime{true});
-        bar.set_option(indicators::option::ShowRemainingTime{true});
-        bar.set_option(indicators::option::BarWidth{50});
+        auto byte = (uint8_t)*cursor++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// <summary>
+/// Formats a number the same way the text tracer does (printf "%#lX").
+/// </summary>
+static void TraceHex(uint64_t value, std::string &result)
+{
+    char buffer[24];
+    snprintf(buffer, sizeof(buffer), "%#lX", (unsigned long)value);
+    result.assign(buffer);
+}
+
+/// <summary>
+/// Formats a raw memory value the same way the text tracer does, "0X" followed by two digits per byte.
+/// </summary>
+static void TraceHexBytes(const char *data, uint64_t size, std::string &result)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    result.assign("0X");
+    for (uint64_t i = 0; i < size; i++)
+    {
+        auto byte = (uint8_t)data[i];
+        result.push_back(digits[byte >> 4]);
+        result.push_back(digits[byte & 0xF]);
+    }
+}
+
+/// <summary>
+/// Parses the number of an event value, hexadecimal with the "0X" prefix the tracer writes or decimal.
+/// </summary>
+static uint64_t TraceNumber(std::string_view value)
+{
+    int base = 10;
+    if (value.size() > 1 && value[0] == '0' && (value[1] == 'X' || value[1] == 'x'))
+    {
+        value.remove_prefix(2);
+        base = 16;
+    }
+    uint64_t result = 0;
+    auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), result, base);
+    if (error != std::errc())
+    {
+        throw AtlasException("Invalid number in trace: " + std::string(value));
+    }
+    return result;
+}
+
+/// <summary>
+/// Splits a text line at its first colon into the key and the rest of the line. The value is null if the line has no colon.
+/// </summary>
+static void SplitTraceLine(const char *begin, const char *end, std::string_view &key, std::string_view &value)
+{
+    const char *colon = std::find(begin, end, ':');
+    key = std::string_view(begin, (size_t)(colon - begin));
+    if (colon == end)
+    {
+        value = std::string_view();
+    }
+    else
+    {
+        value = std::string_view(colon + 1, (size_t)(end - colon - 1));
+    }
+}
+
+/// <summary>
+/// Converts the hexadecimal digits of a text value back into the raw bytes the binary encoding stores.
+/// </summary>
+static void TraceBytes(std::string_view hex, std::string &result)
+{
+    if (hex.size() > 1 && hex[0] == '0' && (hex[1] == 'X' || hex[1] == 'x'))
+    {
+        hex.remove_prefix(2);
+    }
+    result.clear();
+    for (size_t i = 0; i + 1 < hex.size(); i += 2)
+    {
+        uint8_t byte = 0;
+        std::from_chars(hex.data() + i, hex.data() + i + 2, byte, 16);
+        result.push_back((char)byte);
+    }
+}
+
+/// <summary>
+/// The op of a text key. The first character and the length leave a single candidate, so a key is compared against one name at most.
+/// </summary>
+static TraceOp TextOp(std::string_view key)
+{
+    if (key.empty())
+    {
+        return TraceOp::Other;
+    }
+    TraceOp op;
+    switch (key[0])
+    {
+        case 'B':
+            op = key.size() == 7 ? TraceOp::BBEnter : TraceOp::BBExit;
+            break;
+        case 'K':
+            op = key.size() == 11 ? TraceOp::KernelEnter : TraceOp::KernelExit;
+            break;
+        case 'L':
+            op = key.size() == 11 ? TraceOp::LoadAddress : TraceOp::LoadValue;
+            break;
+        case 'S':
+            switch (key.size())
+            {
+                case 4:
+                    op = TraceOp::Skip;
+                    break;
+                case 8:
+                    op = TraceOp::Sequence;
+                    break;
+                case 10:
+                    op = TraceOp::StoreValue;
+                    break;
+                default:
+                    op = TraceOp::StoreAddress;
+                    break;
+            }
+            break;
+        case 'T':
+            op = TraceOp::TraceVersion;
+            break;
+        default:
+            return TraceOp::Other;
+    }
+    return key == TraceOpName(op) ? op : TraceOp::Other;
+}
+
+/// <summary>
+/// Turns the key and value of a text record into an event. Numbers are parsed here, once, and values are converted to raw bytes in scratch.
+/// Other records keep the whole rest of their line, so it can be written back unchanged.
+/// </summary>
+static void TextEvent(std::string_view key, std::string_view value, TraceEvent &event, std::string &scratch)
+{
+    event.op = TextOp(key);
+    if (event.op != TraceOp::Other)
+    {
+        // the value of known records ends at the second colon, as it always has for text traces
+        value = value.substr(0, value.find(':'));
+    }
+    // keys of known events are the static names, only other records point into the line
+    event.key = event.op == TraceOp::Other ? key : TraceOpName(event.op);
+    event.data = value;
+    event.number = 0;
+    switch (event.op)
+    {
+        case TraceOp::LoadValue:
+        case TraceOp::StoreValue:
+            TraceBytes(value, scratch);
+            event.data = scratch;
+            break;
+        case TraceOp::KernelEnter:
+        case TraceOp::KernelExit:
+        case TraceOp::Other:
+            break;
+        default:
+            event.number = TraceNumber(value);
+            event.data = std::string_view();
+            break;
+    }
+}
+
+/// <summary>
+/// Decodes the text line at cursor and advances past it. Returns false if [cursor, end) holds no complete line.
+/// </summary>
+static bool DecodeTextRecord(const char *&cursor, const char *end, TraceEvent &event, std::string &scratch)
+{
+    const char *newline = std::find(cursor, end, '\n');
+    if (newline == end)
+    {
+        return false;
+    }
+    std::string_view key;
+    std::string_view value;
+    SplitTraceLine(cursor, newline, key, value);
+    TextEvent(key, value, event, scratch);
+    cursor = newline + 1;
+    return true;
+}
+
+/// <summary>
+/// Decodes the binary record at cursor and advances past it. Returns false if [cursor, end) holds no complete record.
+/// Numbers are taken straight from the record, values and labels point into it.
+/// </summary>
+static bool DecodeBinaryRecord(const char *&cursor, const char *end, TraceDecodeState &state, TraceEvent &event, std::string &scratch)
+{
+    const char *record = cursor;
+    if (cursor == end)
+    {
+        return false;
+    }
+    auto op = (uint8_t)*cursor++;
+    uint64_t payload;
+    if (!ReadVarint(cursor, end, payload))
+    {
+        cursor = record;
+        return false;
+    }
+    if (op == TraceOpFrame)
+    {
+        // a new frame of a framed trace, its deltas start over
+        state = TraceDecodeState();
+        return DecodeBinaryRecord(cursor, end, state, event, scratch);
+    }
+    event.data = std::string_view();
+    switch (op)
+    {
+        case TraceOpBBEnter:
+        case TraceOpBBExit:
+        {
+            state.previousBlock += (payload >> 1) ^ (~(payload & 1) + 1);
+            event.op = op == TraceOpBBEnter ? TraceOp::BBEnter : TraceOp::BBExit;
+            event.number = state.previousBlock;
+            break;
+        }
+        case TraceOpLoadAddress:
+        {
+            state.previousLoad += (payload >> 1) ^ (~(payload & 1) + 1);
+            event.op = TraceOp::LoadAddress;
+            event.number = state.previousLoad;
+            break;
+        }
+        case TraceOpStoreAddress:
+        {
+            state.previousStore += (payload >> 1) ^ (~(payload & 1) + 1);
+            event.op = TraceOp::StoreAddress;
+            event.number = state.previousStore;
+            break;
+        }
+        case TraceOpSequence:
+        case TraceOpSkip:
+        {
+            event.op = op == TraceOpSequence ? TraceOp::Sequence : TraceOp::Skip;
+            event.number = payload;
+            break;
+        }
+        case TraceOpLoadValue:
+        case TraceOpStoreValue:
+        case TraceOpKernelEnter:
+        case TraceOpKernelExit:
+        case TraceOpText:
+        {
+            if ((uint64_t)(end - cursor) < payload)
+            {
+                cursor = record;
+                return false;
+            }
+            if (op == TraceOpText)
+            {
+                std::string_view key;
+                std::string_view value;
+                SplitTraceLine(cursor, cursor + payload, key, value);
+                TextEvent(key, value, event, scratch);
+                cursor += payload;
+                return true;
+            }
+            switch (op)
+            {
+                case TraceOpLoadValue:
+                    event.op = TraceOp::LoadValue;
+                    break;
+                case TraceOpStoreValue:
+                    event.op = TraceOp::StoreValue;
+                    break;
+                case TraceOpKernelEnter:
+                    event.op = TraceOp::KernelEnter;
+                    break;
+                default:
+                    event.op = TraceOp::KernelExit;
+                    break;
+            }
+            event.number = 0;
+            event.data = std::string_view(cursor, payload);
+            cursor += payload;
+            break;
+        }
+        default:
+        {
+            throw AtlasException("Unrecognized trace opcode: " + std::to_string(op));
+        }
+    }
+    event.key = TraceOpName(event.op);
+    return true;
+}
+
+/// <summary>
+/// Converts an event back into the key and value strings of the text encoding, for tools that work on those.
+/// Numbers and values are formatted into scratch.
+/// </summary>
+static void FormatTraceEvent(const TraceEvent &event, std::string_view &key, std::string_view &value, std::string &scratch)
+{
+    key = event.key;
+    switch (event.op)
+    {
+        case TraceOp::LoadValue:
+        case TraceOp::StoreValue:
+            TraceHexBytes(event.data.data(), event.data.size(), scratch);
+            value = scratch;
+            break;
+        case TraceOp::KernelEnter:
+        case TraceOp::KernelExit:
+            value = event.data;
+            break;
+        case TraceOp::Other:
+            // the value ends at the second colon, as it always has for text traces
+            value = event.data.substr(0, event.data.find(':'));
+            break;
+        case TraceOp::TraceVersion:
+        case TraceOp::Thread:
+            scratch = std::to_string(event.number);
+            value = scratch;
+            break;
+        default:
+            TraceHex(event.number, scratch);
+            value = scratch;
+            break;
+    }
+}
+
+/// <summary>
+/// Decompresses a single frame of a framed trace into output.
+/// </summary>
+static void DecompressTraceFrame(int codec, const char *input, const TraceFrame &frame, std::vector<char> &output)
+{
+    output.resize(frame.rawSize);
+    uint64_t produced = 0;
+    switch (codec)
+    {
+        case TraceCodecZlib:
+        {
+            z_stream strm;
+            strm.zalloc = Z_NULL;
+            strm.zfree = Z_NULL;
+            strm.opaque = Z_NULL;
+            strm.next_in = (Bytef *)input;
+            strm.avail_in = (uInt)frame.size;
+            strm.next_out = (Bytef *)output.data();
+            strm.avail_out = (uInt)output.size();
+            if (inflateInit(&strm) != Z_OK)
+            {
+                throw AtlasException("Failed to decompress trace frame");
+            }
+            int ret = inflate(&strm, Z_FINISH);
+            produced = output.size() - strm.avail_out;
+            inflateEnd(&strm);
+            if (ret != Z_STREAM_END)
+            {
+                throw AtlasException("Failed to decompress trace frame");
+            }
+            break;
+        }
+#ifdef ATLAS_ZSTD
+        case TraceCodecZstd:
+        {
+            size_t ret = ZSTD_decompress(output.data(), output.size(), input, frame.size);
+            if (ZSTD_isError(ret))
+            {
+                throw AtlasException(std::string("Failed to decompress trace frame: ") + ZSTD_getErrorName(ret));
+            }
+            produced = ret;
+            break;
+        }
+#endif
+#ifdef ATLAS_LZ4
+        case TraceCodecLz4:
+        {
+            LZ4F_dctx *lz4;
+            LZ4F_createDecompressionContext(&lz4, LZ4F_VERSION);
+            size_t used = 0;
+            size_t ret = 1;
+            while (ret != 0 && used < frame.size && produced < output.size())
+            {
+                size_t have = output.size() - produced;
+                size_t part = frame.size - used;
+                ret = LZ4F_decompress(lz4, output.data() + produced, &have, input + used, &part, nullptr);
+                if (LZ4F_isError(ret))
+                {
+                    LZ4F_freeDecompressionContext(lz4);
+                    throw AtlasException(std::string("Failed to decompress trace frame: ") + LZ4F_getErrorName(ret));
+                }
+                produced += have;
+                used += part;
+            }
+            LZ4F_freeDecompressionContext(lz4);
+            break;
+        }
+#endif
+        default:
+            memcpy(output.data(), input, frame.rawSize);
+            produced = frame.rawSize;
+            break;
+    }
+    if (produced != frame.rawSize)
+    {
+        throw AtlasException("Trace frame does not match its index entry");
+    }
+}
+
+/// <summary>
+/// Pulls the events of a single trace file, one at a time.
+/// The file is memory mapped and decompressed into a reusable buffer, uncompressed traces are decoded straight from the mapping.
+/// The frames of an indexed trace are decompressed ahead on a pool of threads instead and decoded in order.
+/// The first event is the TraceVersion header if the trace has one.
+/// </summary>
+class TraceReader
+{
+public:
+    /// <summary>
+    /// The version of the trace, known once the first event has been read.
+    /// </summary>
+    int version = 0;
+    /// <summary>
+    /// The codec the file was compressed with, read from the file header.
+    /// </summary>
+    int codec = TraceCodecZlib;
+    /// <summary>
+    /// The number of BLOCK_SIZE blocks in the file and how many of them have been read so far.
+    /// </summary>
+    int64_t blocks = 0;
+    int64_t blocksRead = 0;
+    /// <summary>
+    /// The frame index of a framed trace. Empty for other traces and framed traces whose index is missing.
+    /// </summary>
+    std::vector<TraceFrame> frames;
+
+    /// <summary>
+    /// Opens a trace file. Frames are decompressed on up to threads threads, by default one per core.
+    /// </summary>
+    TraceReader(const std::string &TraceFile, unsigned int threads = std::thread::hardware_concurrency())
+    {
+#ifdef _WIN32
+        std::ifstream inputTrace(TraceFile, std::ios::binary | std::ios::ate);
+        if (!inputTrace)
+        {
+            throw AtlasException("Failed to open trace file: " + TraceFile);
+        }
+        fileData.resize((size_t)inputTrace.tellg());
+        inputTrace.seekg(0, std::ios_base::beg);
+        inputTrace.read(fileData.data(), (std::streamsize)fileData.size());
+        mapBase = fileData.data();
+        mapSize = fileData.size();
+#else
+        int fd = open(TraceFile.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            throw AtlasException("Failed to open trace file: " + TraceFile);
+        }
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0)
+        {
+            close(fd);
+            throw AtlasException("Failed to open trace file: " + TraceFile);
+        }
+        mapSize = (size_t)fileStat.st_size;
+        if (mapSize != 0)
+        {
+            void *map = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+            {
+                close(fd);
+                throw AtlasException("Failed to map trace file: " + TraceFile);
+            }
+            madvise(map, mapSize, MADV_SEQUENTIAL);
+            mapBase = (const char *)map;
+        }
+        close(fd);
+#endif
+        blocks = (int64_t)(mapSize / BLOCK_SIZE) + 1;
+        input = mapBase;
+        inputSize = mapSize;
+
+        //traces without a file header are zlib streams
+        if (mapSize >= TRACE_HEADER_SIZE && std::equal(mapBase, mapBase + strlen(TRACE_MAGIC), TRACE_MAGIC))
+        {
+            codec = (uint8_t)mapBase[strlen(TRACE_MAGIC)];
+            framed = ((uint8_t)mapBase[strlen(TRACE_MAGIC) + 1] & TRACE_FLAG_FRAMED) != 0;
+            input += TRACE_HEADER_SIZE;
+            inputSize -= TRACE_HEADER_SIZE;
+        }
+        if (framed && !ReadIndex() && codec == TraceCodecNone)
+        {
+            // compressed frames end where the decompressor stops, uncompressed records run right into the index
+            Unmap();
+            throw AtlasException("Trace file " + TraceFile + " has no valid frame index, so the end of its records is unknown");
+        }
+
+        switch (codec)
+        {
+            case TraceCodecNone:
+                cursor = input;
+                end = input;
+                break;
+            case TraceCodecZlib:
+            {
+                //init zlib
+                strm.zalloc = Z_NULL;
+                strm.zfree = Z_NULL;
+                strm.opaque = Z_NULL;
+                strm.next_in = Z_NULL;
+                strm.avail_in = 0;
+                int ret = inflateInit(&strm);
+                assert(ret == Z_OK);
+                (void)ret;
+                break;
+            }
+#ifdef ATLAS_ZSTD
+            case TraceCodecZstd:
+                zstd = ZSTD_createDStream();
+                ZSTD_initDStream(zstd);
+                break;
+#endif
+#ifdef ATLAS_LZ4
+            case TraceCodecLz4:
+                LZ4F_createDecompressionContext(&lz4, LZ4F_VERSION);
+                break;
+#endif
+            default:
+                Unmap();
+                throw AtlasException("Trace file " + TraceFile + " uses codec " + std::to_string(codec) + ", which this build does not support");
+        }
+        if (codec != TraceCodecNone)
+        {
+            buffer.resize(TRACE_READ_SIZE);
+            cursor = buffer.data();
+            end = buffer.data();
+        }
+        // uncompressed frames are already in the mapping
+        if (frames.size() > 1 && codec != TraceCodecNone && threads > 1)
+        {
+            StartWorkers(std::min(threads, (unsigned int)frames.size()));
+        }
+    }
+    TraceReader(const TraceReader &) = delete;
+    TraceReader &operator=(const TraceReader &) = delete;
+    ~TraceReader()
+    {
+        StopWorkers();
+        switch (codec)
+        {
+            case TraceCodecZlib:
+                inflateEnd(&strm);
+                break;
+#ifdef ATLAS_ZSTD
+            case TraceCodecZstd:
+                ZSTD_freeDStream(zstd);
+                break;
+#endif
+#ifdef ATLAS_LZ4
+            case TraceCodecLz4:
+                LZ4F_freeDecompressionContext(lz4);
+                break;
+#endif
+            default:
+                break;
+        }
+        Unmap();
+    }
+
+    /// <summary>
+    /// Decodes the next event. Returns false at the end of the trace.
+    /// The views of the event stay valid until the next call.
+    /// </summary>
+    bool Next(TraceEvent &event)
+    {
+        while (true)
+        {
+            bool complete;
+            if (version == TRACE_VERSION_BINARY)
+            {
+                complete = DecodeBinaryRecord(cursor, end, state, event, scratch);
+            }
+            else
+            {
+                complete = DecodeTextRecord(cursor, end, event, scratch);
+                if (complete && version == 0)
+                {
+                    // the first line of the trace names its version
+                    version = TRACE_VERSION_TEXT;
+                    if (event.op == TraceOp::TraceVersion)
+                    {
+                        version = (int)event.number;
+                    }
+                    if (version > TRACE_VERSION_BINARY)
+                    {
+                        throw AtlasException("Unsupported trace version: " + std::to_string(version));
+                    }
+                }
+            }
+            if (complete)
+            {
+                return true;
+            }
+            if (!Fill())
+            {
+                break;
+            }
+        }
+        if (cursor == end)
+        {
+            return false;
+        }
+        // a text trace may end without a trailing newline
+        if (version != TRACE_VERSION_BINARY)
+        {
+            std::string_view key;
+            std::string_view value;
+            SplitTraceLine(cursor, end, key, value);
+            TextEvent(key, value, event, scratch);
+            cursor = end;
+            return true;
+        }
+        spdlog::warn("Trace ended with a truncated record");
+        cursor = end;
+        return false;
     }
 
-    std::ifstream inputTrace;
-    char dataArray[BLOCK_SIZE];
-    char decompressedArray[BLOCK_SIZE];
+private:
+    const char *mapBase = nullptr;
+    size_t mapSize = 0;
+#ifdef _WIN32
+    std::vector<char> fileData;
+#endif
     z_stream strm;
-    int ret;
-
-    //init zlib
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
-    ret = inflateInit(&strm);
-    assert(ret == Z_OK);
-
-    int index = 0;
-
-    //open the file
-    inputTrace.open(TraceFile);
-
-    if (!inputTrace)
-    {
-        throw AtlasException("Failed to open trace file");
-    }
-
-    //get the file size
-    inputTrace.seekg(0, std::ios_base::end);
-    int64_t size = inputTrace.tellg();
-    inputTrace.seekg(0, std::ios_base::beg);
-    int64_t blocks = size / BLOCK_SIZE + 1;
-
-    bool notDone = true;
-    bool seenFirst;
-    std::string priorLine;
-
-    while (notDone)
-    {
-        // read a block size of the trace
-        inputTrace.read(dataArray, BLOCK_SIZE);
-        int64_t bytesRead = inputTrace.gcount();
-        strm.next_in = (Bytef *)dataArray;   // input data to z_lib for decompression
-        strm.avail_in = (uint32_t)bytesRead; // remaining characters in the compressed inputTrace
-        while (strm.avail_in != 0)
-        {
-            // decompress our data
-            strm.next_out = (Bytef *)decompressedArray; // pointer where uncompressed data is written to
-            strm.avail_out = BLOCK_SIZE - 1;            // remaining space in decompressedArray
-            ret = inflate(&strm, Z_NO_FLUSH);
-            assert(ret != Z_STREAM_ERROR);
-
-            // put decompressed data into a string for splitting
-            unsigned int have = BLOCK_SIZE - strm.avail_out;
-            decompressedArray[have - 1] = '\0';
-            std::string bufferString(decompressedArray);
-            std::stringstream stringStream(bufferString);
-            std::string segment;
-            std::getline(stringStream, segment, '\n');
-            char back = bufferString.back();
-            seenFirst = false;
-            while (true)
-            {
-                if (!seenFirst)
+#ifdef ATLAS_ZSTD
+    ZSTD_DStream *zstd = nullptr;
+#endif
+#ifdef ATLAS_LZ4
+    LZ4F_dctx *lz4 = nullptr;
+#endif
+    /// <summary>
+    /// The part of the file that has not been decompressed yet.
+    /// </summary>
+    const char *input = nullptr;
+    size_t inputSize = 0;
+    bool outputFull = false;
+    bool finished = false;
+    bool framed = false;
+    /// <summary>
+    /// Set while the serial decompressor stands at the end of a frame of a framed trace.
+    /// </summary>
+    bool frameEnded = false;
+    TraceDecodeState state;
+    /// <summary>
+    /// The decompressed bytes that have not been decoded yet, [cursor, end). They lie in buffer, or in the mapping for uncompressed traces.
+    /// </summary>
+    std::vector<char> buffer;
+    const char *cursor = nullptr;
+    const char *end = nullptr;
+    std::string scratch;
+    /// <summary>
+    /// Frames decompressed ahead by the workers. Frame n goes into slot n % slots.size() once the frame of the previous round was released.
+    /// </summary>
+    struct FrameSlot
+    {
+        std::vector<char> data;
+        std::string error;
+        bool ready = false;
+    };
+    std::vector<FrameSlot> slots;
+    std::vector<std::thread> workers;
+    std::mutex frameLock;
+    std::condition_variable frameChange;
+    size_t claimed = 0;
+    size_t released = 0;
+    size_t delivered = 0;
+    bool stopping = false;
+
+    void Unmap()
+    {
+#ifndef _WIN32
+        if (mapBase != nullptr)
+        {
+            munmap((void *)mapBase, mapSize);
+            mapBase = nullptr;
+        }
+#endif
+    }
+
+    /// <summary>
+    /// Reads the frame index from the end of a framed trace and leaves it out of the input.
+    /// Without a valid index the frames are read front to back up to the first one that does not decompress. Returns false in that case.
+    /// </summary>
+    bool ReadIndex()
+    {
+        if (inputSize < TRACE_TRAILER_SIZE)
+        {
+            spdlog::warn("Trace has no frame index, it is read serially");
+            return false;
+        }
+        const char *trailer = mapBase + mapSize - TRACE_TRAILER_SIZE;
+        uint64_t count;
+        memcpy(&count, trailer, sizeof(count));
+        if (!std::equal(TRACE_INDEX_MAGIC, TRACE_INDEX_MAGIC + strlen(TRACE_INDEX_MAGIC), trailer + sizeof(count)) || count > (inputSize - TRACE_TRAILER_SIZE) / sizeof(TraceFrame))
+        {
+            spdlog::warn("Trace has no frame index, it is read serially");
+            return false;
+        }
+        const char *index = trailer - count * sizeof(TraceFrame);
+        std::vector<TraceFrame> entries(count);
+        memcpy(entries.data(), index, count * sizeof(TraceFrame));
+        // the frames must tile the file between the header and the index
+        uint64_t expected = TRACE_HEADER_SIZE;
+        for (const auto &frame : entries)
+        {
+            if (frame.offset != expected)
+            {
+                break;
+            }
+            expected = frame.offset + frame.size;
+        }
+        if (expected != (uint64_t)(index - mapBase))
+        {
+            spdlog::warn("Trace frame index is damaged, the trace is read serially");
+            return false;
+        }
+        frames = std::move(entries);
+        inputSize = (size_t)(index - input);
+        return true;
+    }
+
+    /// <summary>
+    /// Ends the serial read of a framed trace at the end of the last frame, once what follows does not decompress.
+    /// Those are the bytes of the index that failed to load.
+    /// </summary>
+    size_t EndAtFrame()
+    {
+        spdlog::warn("Trace data after the last frame is not a frame, it is taken as the frame index");
+        input += inputSize;
+        inputSize = 0;
+        finished = true;
+        return 0;
+    }
+
+    void StartWorkers(unsigned int threads)
+    {
+        slots.resize(2 * threads);
+        for (unsigned int i = 0; i < threads; i++)
+        {
+            workers.emplace_back([this]() {
+                while (true)
                 {
-                    segment = priorLine.append(segment);
-                    seenFirst = true;
+                    size_t frame;
+                    {
+                        std::unique_lock<std::mutex> guard(frameLock);
+                        frameChange.wait(guard, [this]() { return stopping || claimed == frames.size() || claimed < released + slots.size(); });
+                        if (stopping || claimed == frames.size())
+                        {
+                            return;
+                        }
+                        frame = claimed++;
+                    }
+                    auto &slot = slots[frame % slots.size()];
+                    try
+                    {
+                        DecompressTraceFrame(codec, mapBase + frames[frame].offset, frames[frame], slot.data);
+                    }
+                    catch (std::exception &e)
+                    {
+                        slot.error = e.what();
+                    }
+                    {
+                        std::lock_guard<std::mutex> guard(frameLock);
+                        slot.ready = true;
+                    }
+                    frameChange.notify_all();
                 }
-                // split it by the colon between the instruction and value
-                std::stringstream itstream(segment);
-                std::string key;
-                std::string value;
-                std::string error;
-                std::getline(itstream, key, ':');
-                std::getline(itstream, value, ':');
-                bool fin = false;
-                if (!std::getline(stringStream, segment, '\n'))
+            });
+        }
+    }
+
+    void StopWorkers()
+    {
+        {
+            std::lock_guard<std::mutex> guard(frameLock);
+            stopping = true;
+        }
+        frameChange.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    /// <summary>
+    /// Releases the frame the decoder is done with and hands it the next one, in order.
+    /// </summary>
+    bool FillFrame()
+    {
+        if (cursor != end)
+        {
+            throw AtlasException("Trace frame ends inside a record");
+        }
+        std::unique_lock<std::mutex> guard(frameLock);
+        if (delivered > released)
+        {
+            slots[released % slots.size()].ready = false;
+            released++;
+            frameChange.notify_all();
+        }
+        if (delivered == frames.size())
+        {
+            return false;
+        }
+        auto &slot = slots[delivered % slots.size()];
+        frameChange.wait(guard, [&]() { return slot.ready; });
+        if (!slot.error.empty())
+        {
+            throw AtlasException(slot.error);
+        }
+        cursor = slot.data.data();
+        end = slot.data.data() + slot.data.size();
+        blocksRead = (int64_t)((frames[delivered].offset + frames[delivered].size) / BLOCK_SIZE);
+        delivered++;
+        return true;
+    }
+
+    /// <summary>
+    /// Makes more of the file available to the decoder, keeping the undecoded tail. Returns false once the file is exhausted.
+    /// </summary>
+    bool Fill()
+    {
+        if (!workers.empty())
+        {
+            return FillFrame();
+        }
+        if (codec == TraceCodecNone)
+        {
+            // the mapping is contiguous, so the window simply grows
+            if (inputSize == 0)
+            {
+                return false;
+            }
+            size_t part = std::min(inputSize, (size_t)TRACE_READ_SIZE);
+            end += part;
+            input += part;
+            inputSize -= part;
+            blocksRead = (int64_t)((size_t)(input - mapBase) / BLOCK_SIZE);
+            return true;
+        }
+
+        size_t left = (size_t)(end - cursor);
+        if (left != 0 && cursor != buffer.data())
+        {
+            memmove(buffer.data(), cursor, left);
+        }
+        // a record larger than half the buffer needs more room
+        if (left > buffer.size() / 2)
+        {
+            buffer.resize(buffer.size() * 2);
+        }
+        size_t have = left;
+        while (!finished && have < buffer.size())
+        {
+            // a full output buffer means the decompressor may still hold output without further input
+            if (inputSize == 0 && !outputFull)
+            {
+                finished = true;
+                break;
+            }
+            size_t produced = Decompress(buffer.data() + have, buffer.size() - have);
+            outputFull = produced == buffer.size() - have;
+            have += produced;
+        }
+        cursor = buffer.data();
+        end = buffer.data() + have;
+        blocksRead = (int64_t)((size_t)(input - mapBase) / BLOCK_SIZE);
+        return have != left;
+    }
+
+    /// <summary>
+    /// Decompresses as much of the input as fits into output. Returns the number of bytes written.
+    /// </summary>
+    size_t Decompress(char *output, size_t capacity)
+    {
+        switch (codec)
+        {
+            case TraceCodecZlib:
+            {
+                auto inputPart = (uInt)std::min(inputSize, (size_t)1 << 30);
+                auto outputPart = (uInt)std::min(capacity, (size_t)1 << 30);
+                strm.next_in = (Bytef *)input;       // input data to z_lib for decompression
+                strm.avail_in = inputPart;           // remaining characters in the compressed inputTrace
+                strm.next_out = (Bytef *)output;     // pointer where uncompressed data is written to
+                strm.avail_out = outputPart;         // remaining space in the output
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                assert(ret != Z_STREAM_ERROR);
+                if (ret == Z_DATA_ERROR || ret == Z_MEM_ERROR || ret == Z_NEED_DICT)
+                {
+                    if (frameEnded && ret == Z_DATA_ERROR)
+                    {
+                        return EndAtFrame();
+                    }
+                    throw AtlasException("Failed to decompress trace file");
+                }
+                input += inputPart - strm.avail_in;
+                inputSize -= inputPart - strm.avail_in;
+                frameEnded = false;
+                if (ret == Z_STREAM_END)
                 {
-                    if (back == '\n')
+                    // the frames of a framed trace are separate zlib streams
+                    if (framed && inputSize > 0)
                     {
-                        fin = true;
+                        inflateReset(&strm);
+                        frameEnded = true;
                     }
                     else
                     {
-                        break;
+                        finished = true;
                     }
                 }
-
-                //process the line here
-                LogicFunction(key, value);
-                if (fin)
+                return outputPart - strm.avail_out;
+            }
+#ifdef ATLAS_ZSTD
+            case TraceCodecZstd:
+            {
+                ZSTD_inBuffer in = {input, inputSize, 0};
+                ZSTD_outBuffer out = {output, capacity, 0};
+                size_t ret = ZSTD_decompressStream(zstd, &out, &in);
+                if (ZSTD_isError(ret))
                 {
-                    break;
+                    if (frameEnded)
+                    {
+                        return EndAtFrame();
+                    }
+                    throw AtlasException(std::string("Failed to decompress trace file: ") + ZSTD_getErrorName(ret));
+                }
+                input += in.pos;
+                inputSize -= in.pos;
+                // zero means the frame is complete and flushed
+                frameEnded = framed && ret == 0;
+                return out.pos;
+            }
+#endif
+#ifdef ATLAS_LZ4
+            case TraceCodecLz4:
+            {
+                size_t have = capacity;
+                size_t used = inputSize;
+                size_t ret = LZ4F_decompress(lz4, output, &have, input, &used, nullptr);
+                if (LZ4F_isError(ret))
+                {
+                    if (frameEnded)
+                    {
+                        return EndAtFrame();
+                    }
+                    throw AtlasException(std::string("Failed to decompress trace file: ") + LZ4F_getErrorName(ret));
                 }
+                input += used;
+                inputSize -= used;
+                // zero means the frame is complete
+                frameEnded = framed && ret == 0;
+                return have;
+            }
+#endif
+            default:
+                return 0;
+        }
+    }
+};
+
+/// <summary>
+/// The run ID in the header of a trace file, zero for files without one.
+/// </summary>
+static uint16_t TraceRun(const std::string &TraceFile)
+{
+    std::ifstream file(TraceFile, std::ios::binary);
+    char header[TRACE_HEADER_SIZE];
+    if (!file.read(header, TRACE_HEADER_SIZE) || !std::equal(header, header + strlen(TRACE_MAGIC), TRACE_MAGIC))
+    {
+        return 0;
+    }
+    return (uint16_t)((uint8_t)header[TRACE_RUN_OFFSET] | (uint8_t)header[TRACE_RUN_OFFSET + 1] << 8);
+}
+
+/// <summary>
+/// Lists the per-thread files of a trace. The trace of the main thread is TraceFile itself, the other threads wrote TraceFile.1, TraceFile.2, ...
+/// The list ends at the first file whose run ID differs from the one of TraceFile.
+/// </summary>
+static std::vector<std::string> GetThreadTraces(const std::string &TraceFile)
+{
+    std::vector<std::string> files = {TraceFile};
+    uint16_t run = TraceRun(TraceFile);
+    for (int i = 1;; i++)
+    {
+        std::string name = TraceFile + "." + std::to_string(i);
+        std::ifstream test(name, std::ios::binary);
+        if (!test)
+        {
+            break;
+        }
+        // files left over from an earlier run of another thread count carry another run ID
+        if (run != 0 && TraceRun(name) != run)
+        {
+            spdlog::warn("Ignoring " + name + " and the thread traces after it, they belong to another run than " + TraceFile);
+            break;
+        }
+        files.push_back(name);
+    }
+    return files;
+}
+
+/// <summary>
+/// Feeds the events of the given trace files to the logic function, interleaved by their sequence records.
+/// Sequence records themselves are consumed. When the events switch from one file to another a Thread event with the index of the file is passed on first.
+/// </summary>
+static void MergeTraces(const std::vector<std::string> &TraceFiles, const std::function<void(const TraceEvent &)> &LogicFunction, const std::string &barPrefix, bool noBar)
+{
+    std::cout << "\e[?25l";
+    indicators::ProgressBar bar;
+    int previousCount = 0;
+    if (!noBar)
+    {
+        bar.set_option(indicators::option::PrefixText{barPrefix});
+        bar.set_option(indicators::option::ShowElapsedTime{true});
+        bar.set_option(indicators::option::ShowRemainingTime{true});
+        bar.set_option(indicators::option::BarWidth{50});
+    }
+
+    size_t count = TraceFiles.size();
+    std::vector<std::unique_ptr<TraceReader>> readers;
+    int64_t blocks = 0;
+    // every reader holds two frames per thread, so the cores are split among the files instead of given to each
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency() / (unsigned int)std::max<size_t>(count, 1));
+    for (const auto &file : TraceFiles)
+    {
+        readers.push_back(std::make_unique<TraceReader>(file, threads));
+        blocks += readers.back()->blocks;
+    }
+    int64_t index = 0;
+    std::vector<int64_t> blocksRead(count, 0);
+    std::vector<TraceEvent> events(count);
+    std::vector<uint64_t> segments(count, 0);
+    std::vector<bool> alive(count);
+
+    // peeks the next event of a file, consuming the sequence records in front of it
+    auto advance = [&](size_t i) {
+        while ((alive[i] = readers[i]->Next(events[i])) && events[i].op == TraceOp::Sequence)
+        {
+            segments[i] = events[i].number;
+        }
+    };
+    for (size_t i = 0; i < count; i++)
+    {
+        advance(i);
+        // only the header of the main trace is passed on
+        if (i > 0 && alive[i] && events[i].op == TraceOp::TraceVersion)
+        {
+            advance(i);
+        }
+    }
+
+    size_t current = count;
+    while (true)
+    {
+        // the file whose pending events come first in the global sequence
+        size_t next = count;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (alive[i] && (next == count || segments[i] < segments[next]))
+            {
+                next = i;
             }
-            priorLine = segment;
         }
-        index++;
-        notDone = (ret != Z_STREAM_END);
-        if (index > blocks)
+        if (next == count)
         {
-            notDone = false;
+            break;
         }
-        float percent = (float)index / (float)blocks * 100.0f;
-        if (!noBar)
+        if (current != count && next != current)
         {
-            bar.set_progress(percent);
-            bar.set_option(indicators::option::PostfixText{"Block " + std::to_string(index) + "/" + std::to_string(blocks)});
+            TraceEvent thread;
+            thread.op = TraceOp::Thread;
+            thread.key = TraceOpName(TraceOp::Thread);
+            thread.number = next;
+            LogicFunction(thread);
         }
-        else
+        current = next;
+        uint64_t segment = segments[current];
+        while (alive[current] && segments[current] == segment)
         {
-            int iPercent = (int)percent;
-            if (iPercent > previousCount + 5)
+            LogicFunction(events[current]);
+            advance(current);
+            if (readers[current]->blocksRead != blocksRead[current])
             {
-                previousCount = ((iPercent / 5) + 1) * 5;
-                //spdlog::info("Completed block {0:d} of {1:d}", index, blocks);
+                index += readers[current]->blocksRead - blocksRead[current];
+                blocksRead[current] = readers[current]->blocksRead;
+                float percent = (float)index / (float)blocks * 100.0f;
+                if (!noBar)
+                {
+                    bar.set_progress(percent);
+                    bar.set_option(indicators::option::PostfixText{"Block " + std::to_string(index) + "/" + std::to_string(blocks)});
+                }
+                else
+                {
+                    int iPercent = (int)percent;
+                    if (iPercent > previousCount + 5)
+                    {
+                        previousCount = ((iPercent / 5) + 1) * 5;
+                        //spdlog::info("Completed block {0:d} of {1:d}", index, blocks);
+                    }
+                }
             }
         }
     }
@@ -143,8 +1178,47 @@ static void ProcessTrace(const std::string &TraceFile, const std::function<void(
     {
         bar.mark_as_completed();
     }
-
-    inflateEnd(&strm);
-    inputTrace.close();
     std::cout << "\e[?25h";
-}
\ No newline at end of file
+}
+
+/// <summary>
+/// Feeds the events of the given trace files to the logic function as the key and value strings of the text encoding.
+/// </summary>
+static void MergeTraces(const std::vector<std::string> &TraceFiles, const std::function<void(std::string_view, std::string_view)> &LogicFunction, const std::string &barPrefix, bool noBar)
+{
+    std::string scratch;
+    MergeTraces(
+        TraceFiles, [&](const TraceEvent &event) {
+            std::string_view key;
+            std::string_view value;
+            FormatTraceEvent(event, key, value, scratch);
+            LogicFunction(key, value);
+        },
+        barPrefix, noBar);
+}
+
+/// <summary>
+/// Feeds the events of a single trace file to the logic function, e.g. to consume a multithreaded trace one thread at a time.
+/// </summary>
+static void ProcessTraceFile(const std::string &TraceFile, const std::function<void(const TraceEvent &)> &LogicFunction, const std::string &barPrefix = "", bool noBar = false)
+{
+    MergeTraces({TraceFile}, LogicFunction, barPrefix, noBar);
+}
+
+static void ProcessTraceFile(const std::string &TraceFile, const std::function<void(std::string_view, std::string_view)> &LogicFunction, const std::string &barPrefix = "", bool noBar = false)
+{
+    MergeTraces({TraceFile}, LogicFunction, barPrefix, noBar);
+}
+
+/// <summary>
+/// Feeds the events of a trace to the logic function. The traces of all threads are merged back into a single stream of events.
+/// </summary>
+static void ProcessTrace(const std::string &TraceFile, const std::function<void(const TraceEvent &)> &LogicFunction, const std::string &barPrefix = "", bool noBar = false)
+{
+    MergeTraces(GetThreadTraces(TraceFile), LogicFunction, barPrefix, noBar);
+}
+
+static void ProcessTrace(const std::string &TraceFile, const std::function<void(std::string_view, std::string_view)> &LogicFunction, const std::string &barPrefix = "", bool noBar = false)
+{
+    MergeTraces(GetThreadTraces(TraceFile), LogicFunction, barPrefix, noBar);
+}
@@ -0,0 +1,55 @@
+#include "Backend/BackendProfile.h"
+#include "AtlasUtil/TraceFormat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void DumpBlockProfile(uint64_t *counts, uint64_t size)
+{
+    char *pn = getenv("PROFILE_NAME");
+    if (pn == NULL)
+    {
+        pn = "profile.csv";
+    }
+
+    FILE *profileFile = fopen(pn, "w");
+    if (profileFile == NULL)
+    {
+        printf("Failed to open block profile %s\n", pn);
+        return;
+    }
+    for (uint64_t i = 0; i < size; i++)
+    {
+        if (counts[i] != 0)
+        {
+#if defined _WIN32
+            fprintf(profileFile, "%llu,%llu\n", i, counts[i]);
+#else
+            fprintf(profileFile, "%lu,%lu\n", i, counts[i]);
+#endif
+        }
+    }
+    fclose(profileFile);
+}
+
+void DumpEdgeProfile(uint64_t *counts, uint64_t size)
+{
+    char *pn = getenv("PROFILE_NAME");
+    if (pn == NULL)
+    {
+        pn = "profile.bin";
+    }
+
+    FILE *profileFile = fopen(pn, "wb");
+    if (profileFile == NULL)
+    {
+        printf("Failed to open edge profile %s\n", pn);
+        return;
+    }
+    char header[EDGE_PROFILE_HEADER_SIZE] = {0};
+    memcpy(header, EDGE_PROFILE_MAGIC, strlen(EDGE_PROFILE_MAGIC));
+    fwrite(header, 1, EDGE_PROFILE_HEADER_SIZE, profileFile);
+    fwrite(&size, sizeof(uint64_t), 1, profileFile);
+    fwrite(counts, sizeof(uint64_t), size, profileFile);
+    fclose(profileFile);
+}
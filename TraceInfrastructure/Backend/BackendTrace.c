@@ -1,65 +1,1218 @@
+#ifdef __linux__
+//needed for O_DIRECT
+#define _GNU_SOURCE
+#endif
 #include "Backend/BackendTrace.h"
+#include "AtlasUtil/TraceFormat.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <zlib.h>
+#ifdef ATLAS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ATLAS_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+int TraceCompressionLevel;
+int TraceVersion;
+int TraceCodec;
+int TraceCodecThreads;
+bool TraceDirect;
+char *TraceFilename;
+/// <summary>
+/// Burst sampling. When TraceSampleOff is not zero every thread records TraceSampleOn blocks and then skips TraceSampleOff blocks.
+/// </summary>
+uint64_t TraceSampleOn;
+uint64_t TraceSampleOff;
+/// <summary>
+/// Binary traces are cut into independently compressed frames of about this many bytes of records, so readers can decompress them in parallel.
+/// Zero writes a single continuous stream.
+/// </summary>
+uint64_t TraceFrameSize;
+/// <summary>
+/// The number of events a thread writes before it checks whether another thread wrote in between and claims a new sequence number.
+/// </summary>
+uint64_t TraceSequenceEvents;
+/// <summary>
+/// The run ID written to the header of every file of the trace.
+/// </summary>
+uint16_t TraceRun;
+/// <summary>
+/// The maximum ammount of bytes to store in a buffer before flushing it.
+/// </summary>
+#define BUFSIZE 128 * 1024
+
+/// <summary>
+/// The default number of buffers in the pool of the asynchronous writer.
+/// </summary>
+#define TRACE_DEFAULT_BUFFERS 4
+
+/// <summary>
+/// The default number of zstd worker threads.
+/// </summary>
+#define TRACE_DEFAULT_CODEC_THREADS 4
+
+/// <summary>
+/// The default size of a trace frame in MB.
+/// </summary>
+#define TRACE_DEFAULT_FRAME_SIZE 8
+
+/// <summary>
+/// The default number of events between sequence checks. Large enough that the shared sequence is rarely touched.
+/// </summary>
+#define TRACE_DEFAULT_SEQUENCE_EVENTS 1024
+
+/// <summary>
+/// The largest chunk handed to lz4 at once, so the compressed chunk always fits the output buffer.
+/// </summary>
+#define LZ4_CHUNK 64 * 1024
+
+/// <summary>
+/// The size of the staging buffer that collects compressed output for a single write, and its alignment for O_DIRECT.
+/// </summary>
+#define STAGESIZE 1024 * 1024
+#define STAGEALIGN 4096
+
+/// <summary>
+/// A buffer of the asynchronous writer. Full buffers are queued together with the stream they belong to.
+/// </summary>
+typedef struct TraceBuffer
+{
+    struct TraceStream *stream;
+    unsigned int size;
+    bool finish;
+    /// <summary>
+    /// Set if the buffer ends a frame, frame then holds its index entry without the file location.
+    /// </summary>
+    bool endFrame;
+    TraceFrame frame;
+    struct TraceBuffer *next;
+    uint8_t data[BUFSIZE];
+} TraceBuffer;
+
+/// <summary>
+/// The trace of a single thread. Every thread appends to its own buffer and compresses into its own file, so events need no locks.
+/// The thread that opens the trace writes TRACE_NAME, the Nth other thread to produce an event writes TRACE_NAME.N.
+/// </summary>
+typedef struct TraceStream
+{
+    uint8_t *buffer;
+    unsigned int index;
+    TraceBuffer *current;
+    z_stream strm;
+#ifdef ATLAS_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+#ifdef ATLAS_LZ4
+    LZ4F_cctx *lz4;
+#endif
+    int fd;
+    uint8_t *stage;
+    size_t stageIndex;
+    unsigned int thread;
+    bool release;
+    /// <summary>
+    /// Set while the thread writes an event to the stream. Closing the trace waits for it to clear before finishing the stream.
+    /// </summary>
+    atomic_bool writing;
+    /// <summary>
+    /// The previous block ID and addresses, used as the base of the binary delta encoding.
+    /// </summary>
+    uint64_t previousBlock;
+    uint64_t previousLoad;
+    uint64_t previousStore;
+    /// <summary>
+    /// The blocks left in the current sampling phase, whether that phase skips and how many blocks the current gap skipped so far.
+    /// </summary>
+    uint64_t samplePhase;
+    bool sampleSkipping;
+    uint64_t sampleSkipped;
+    /// <summary>
+    /// The events the thread may still write before its next sequence check.
+    /// </summary>
+    uint64_t sequenceLeft;
+    /// <summary>
+    /// The current frame as seen by the thread: its number, bytes and records so far and its first block.
+    /// </summary>
+    uint64_t frameNumber;
+    uint64_t frameRaw;
+    uint64_t frameRecords;
+    uint64_t frameFirstBlock;
+    /// <summary>
+    /// The frame index as seen by the compressor: bytes written to the file, where the current frame started and the entries of the finished frames.
+    /// </summary>
+    uint64_t written;
+    uint64_t frameStart;
+    TraceFrame *frames;
+    uint64_t frameCount;
+    uint64_t frameCapacity;
+    bool indexFailed;
+    struct TraceStream *next;
+    uint8_t output[BUFSIZE];
+} TraceStream;
+
+/// <summary>
+/// The stream of the calling thread. Created on the first event of the thread.
+/// </summary>
+_Thread_local TraceStream *traceStream = NULL;
+/// <summary>
+/// Set once the stream of the calling thread has been finished, later events of the thread are dropped.
+/// </summary>
+_Thread_local bool traceFinished = false;
+
+/// <summary>
+/// Streams that have not been finished yet. Only touched when a thread starts or stops tracing.
+/// </summary>
+TraceStream *traceStreams = NULL;
+atomic_flag streamLock = ATOMIC_FLAG_INIT;
+atomic_bool traceOpen = false;
+atomic_uint threadCount = 1;
+
+/// <summary>
+/// Orders the per-thread traces. Every TraceSequenceEvents events a thread checks whether another one claimed a number since it did,
+/// and if so writes a sequence record with the next number. Merging the traces by these numbers restores the interleaving to the
+/// granularity of these batches. Checking on every event kept the line of the counter bouncing between cores and could double the trace.
+/// </summary>
+atomic_uint_fast64_t traceSequence = 1;
+_Atomic(TraceStream *) lastWriter = NULL;
+
+#ifndef _WIN32
+pthread_key_t streamKey;
+
+/// <summary>
+/// Asynchronous writer state. When TRACE_ASYNC is set, full buffers are handed to a writer thread which compresses and writes them.
+/// Producers only block when every buffer of the pool is waiting to be written.
+/// </summary>
+bool TraceAsync = false;
+unsigned int TraceBufferCount;
+TraceBuffer *freeBuffers = NULL;
+TraceBuffer *fullHead = NULL;
+TraceBuffer *fullTail = NULL;
+bool writerClosing = false;
+pthread_mutex_t bufferLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t bufferFreed = PTHREAD_COND_INITIALIZER;
+pthread_cond_t bufferFilled = PTHREAD_COND_INITIALIZER;
+pthread_t writerThread;
+
+/// <summary>
+/// Backpressure counters. How many buffers were handed off, how often a producer found the pool empty and how long it waited in total.
+/// </summary>
+uint64_t buffersSubmitted = 0;
+uint64_t producerWaits = 0;
+uint64_t producerWaitNs = 0;
+#endif
+
+static void LockStreams()
+{
+    while (atomic_flag_test_and_set_explicit(&streamLock, memory_order_acquire))
+    {
+    }
+}
+
+static void UnlockStreams()
+{
+    atomic_flag_clear_explicit(&streamLock, memory_order_release);
+}
+
+/// <summary>
+/// Writes all of data to the file, retrying partial and interrupted writes.
+/// </summary>
+static void WriteAll(int fd, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+#ifdef _WIN32
+        int written = _write(fd, data, size > INT32_MAX ? INT32_MAX : (unsigned int)size);
+#else
+        ssize_t written = write(fd, data, size);
+#endif
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            fprintf(stderr, "Failed to write trace: %s\n", strerror(errno));
+            return;
+        }
+        data += written;
+        size -= (size_t)written;
+    }
+}
+
+/// <summary>
+/// Writes the staged output to the file of the stream.
+/// </summary>
+static void FlushStage(TraceStream *stream)
+{
+    WriteAll(stream->fd, stream->stage, stream->stageIndex);
+    stream->stageIndex = 0;
+}
+
+/// <summary>
+/// Writes compressed output to the file of the stream. Output is collected in the staging buffer so the file sees few large writes.
+/// </summary>
+static void WriteOutput(TraceStream *stream, const uint8_t *data, size_t size)
+{
+    stream->written += size;
+#ifndef _WIN32
+    if (!TraceDirect && stream->stageIndex + size > STAGESIZE)
+    {
+        //hand the staged output and the new output to the kernel in one call
+        struct iovec parts[2] = {{stream->stage, stream->stageIndex}, {(void *)data, size}};
+        ssize_t written;
+        do
+        {
+            written = writev(stream->fd, parts, 2);
+        } while (written < 0 && errno == EINTR);
+        if (written < 0)
+        {
+            fprintf(stderr, "Failed to write trace: %s\n", strerror(errno));
+            stream->stageIndex = 0;
+            return;
+        }
+        //finish whatever the kernel did not take
+        size_t staged = (size_t)written < stream->stageIndex ? (size_t)written : stream->stageIndex;
+        WriteAll(stream->fd, stream->stage + staged, stream->stageIndex - staged);
+        WriteAll(stream->fd, data + ((size_t)written - staged), size - ((size_t)written - staged));
+        stream->stageIndex = 0;
+        return;
+    }
+#endif
+    //with O_DIRECT only full, aligned stages are written
+    while (stream->stageIndex + size >= STAGESIZE)
+    {
+        size_t part = STAGESIZE - stream->stageIndex;
+        memcpy(stream->stage + stream->stageIndex, data, part);
+        stream->stageIndex += part;
+        data += part;
+        size -= part;
+        FlushStage(stream);
+    }
+    memcpy(stream->stage + stream->stageIndex, data, size);
+    stream->stageIndex += size;
+}
+
+/// <summary>
+/// Opens a trace file for writing, with O_DIRECT if TRACE_DIRECT is set and the file system supports it. Returns -1 on failure.
+/// </summary>
+static int OpenOutput(const char *name)
+{
+#ifdef _WIN32
+    return _open(name, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+#ifdef O_DIRECT
+    if (TraceDirect)
+    {
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (fd >= 0)
+        {
+            return fd;
+        }
+    }
+#endif
+    return open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+/// <summary>
+/// Writes the remaining staged output, then syncs and closes the file of the stream.
+/// </summary>
+static void CloseOutput(TraceStream *stream)
+{
+#ifdef O_DIRECT
+    //the tail is not a multiple of the block size, so it is written without O_DIRECT
+    int flags = fcntl(stream->fd, F_GETFL);
+    if (flags >= 0 && (flags & O_DIRECT) != 0)
+    {
+        fcntl(stream->fd, F_SETFL, flags & ~O_DIRECT);
+    }
+#endif
+    FlushStage(stream);
+#ifdef _WIN32
+    _commit(stream->fd);
+    _close(stream->fd);
+#else
+    fsync(stream->fd);
+    close(stream->fd);
+#endif
+}
+
+///Modified from https://stackoverflow.com/questions/4538586/how-to-compress-a-buffer-with-zlib
+static void CompressZlib(TraceStream *stream, uint8_t *buffer, unsigned int size, bool finish)
+{
+    int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+    stream->strm.next_in = buffer;
+    stream->strm.avail_in = size;
+    stream->strm.next_out = stream->output;
+    stream->strm.avail_out = BUFSIZE;
+    while (stream->strm.avail_in != 0 || flush == Z_FINISH)
+    {
+        int ret = deflate(&stream->strm, flush);
+
+        if (stream->strm.avail_out == 0)
+        {
+            WriteOutput(stream, stream->output, BUFSIZE);
+            stream->strm.next_out = stream->output;
+            stream->strm.avail_out = BUFSIZE;
+        }
+        else if (ret == Z_STREAM_END)
+        {
+            break;
+        }
+    }
+    WriteOutput(stream, stream->output, BUFSIZE - stream->strm.avail_out);
+}
+
+#ifdef ATLAS_ZSTD
+static void CompressZstd(TraceStream *stream, uint8_t *buffer, unsigned int size, bool finish)
+{
+    ZSTD_inBuffer in = {buffer, size, 0};
+    ZSTD_EndDirective mode = finish ? ZSTD_e_end : ZSTD_e_continue;
+    while (true)
+    {
+        ZSTD_outBuffer out = {stream->output, BUFSIZE, 0};
+        size_t remaining = ZSTD_compressStream2(stream->zstd, &out, &in, mode);
+        if (ZSTD_isError(remaining))
+        {
+            fprintf(stderr, "Trace compression failed: %s\n", ZSTD_getErrorName(remaining));
+            return;
+        }
+        WriteOutput(stream, stream->output, out.pos);
+        if (finish ? remaining == 0 : in.pos == in.size)
+        {
+            break;
+        }
+    }
+}
+#endif
+
+#ifdef ATLAS_LZ4
+static void CompressLz4(TraceStream *stream, uint8_t *buffer, unsigned int size, bool finish)
+{
+    for (unsigned int offset = 0; offset < size; offset += LZ4_CHUNK)
+    {
+        size_t chunk = size - offset < LZ4_CHUNK ? size - offset : LZ4_CHUNK;
+        size_t written = LZ4F_compressUpdate(stream->lz4, stream->output, BUFSIZE, buffer + offset, chunk, NULL);
+        if (LZ4F_isError(written))
+        {
+            fprintf(stderr, "Trace compression failed: %s\n", LZ4F_getErrorName(written));
+            return;
+        }
+        WriteOutput(stream, stream->output, written);
+    }
+    if (finish)
+    {
+        size_t written = LZ4F_compressEnd(stream->lz4, stream->output, BUFSIZE, NULL);
+        if (!LZ4F_isError(written))
+        {
+            WriteOutput(stream, stream->output, written);
+        }
+    }
+}
+#endif
+
+/// <summary>
+/// Compresses size bytes of buffer with the codec of the trace and writes the result to the file of the stream.
+/// Finishing ends the compressed stream.
+/// </summary>
+static void CompressBuffer(TraceStream *stream, uint8_t *buffer, unsigned int size, bool finish)
+{
+    switch (TraceCodec)
+    {
+#ifdef ATLAS_ZSTD
+        case TraceCodecZstd:
+            CompressZstd(stream, buffer, size, finish);
+            break;
+#endif
+#ifdef ATLAS_LZ4
+        case TraceCodecLz4:
+            CompressLz4(stream, buffer, size, finish);
+            break;
+#endif
+        case TraceCodecNone:
+            WriteOutput(stream, buffer, size);
+            break;
+        default:
+            CompressZlib(stream, buffer, size, finish);
+            break;
+    }
+}
+
+#ifdef ATLAS_LZ4
+/// <summary>
+/// Writes the header of a new lz4 frame. Returns false on failure.
+/// </summary>
+static bool BeginLz4(TraceStream *stream)
+{
+    LZ4F_preferences_t preferences;
+    memset(&preferences, 0, sizeof(preferences));
+    preferences.frameInfo.blockSizeID = LZ4F_max64KB;
+    size_t written = LZ4F_compressBegin(stream->lz4, stream->output, BUFSIZE, &preferences);
+    if (LZ4F_isError(written))
+    {
+        return false;
+    }
+    WriteOutput(stream, stream->output, written);
+    return true;
+}
+#endif
+
+/// <summary>
+/// Writes the file header and sets up the compressor of the stream. Returns false on failure.
+/// </summary>
+static bool InitCodec(TraceStream *stream)
+{
+    uint8_t header[TRACE_HEADER_SIZE] = {0};
+    memcpy(header, TRACE_MAGIC, strlen(TRACE_MAGIC));
+    header[strlen(TRACE_MAGIC)] = (uint8_t)TraceCodec;
+    header[strlen(TRACE_MAGIC) + 1] = TraceFrameSize != 0 ? TRACE_FLAG_FRAMED : 0;
+    header[TRACE_RUN_OFFSET] = (uint8_t)TraceRun;
+    header[TRACE_RUN_OFFSET + 1] = (uint8_t)(TraceRun >> 8);
+    WriteOutput(stream, header, TRACE_HEADER_SIZE);
+    stream->frameStart = stream->written;
+    switch (TraceCodec)
+    {
+#ifdef ATLAS_ZSTD
+        case TraceCodecZstd:
+        {
+            stream->zstd = ZSTD_createCCtx();
+            if (stream->zstd == NULL)
+            {
+                return false;
+            }
+            ZSTD_CCtx_setParameter(stream->zstd, ZSTD_c_compressionLevel, TraceCompressionLevel);
+            //fails harmlessly if zstd was built without multithreading
+            ZSTD_CCtx_setParameter(stream->zstd, ZSTD_c_nbWorkers, TraceCodecThreads);
+            return true;
+        }
+#endif
+#ifdef ATLAS_LZ4
+        case TraceCodecLz4:
+        {
+            if (LZ4F_isError(LZ4F_createCompressionContext(&stream->lz4, LZ4F_VERSION)))
+            {
+                return false;
+            }
+            return BeginLz4(stream);
+        }
+#endif
+        case TraceCodecNone:
+            return true;
+        default:
+            stream->strm.zalloc = Z_NULL;
+            stream->strm.zfree = Z_NULL;
+            stream->strm.opaque = Z_NULL;
+            return deflateInit(&stream->strm, TraceCompressionLevel) == Z_OK;
+    }
+}
+
+/// <summary>
+/// Takes the index entry of the frame the thread just finished and starts the next one, with fresh delta bases.
+/// </summary>
+static TraceFrame TakeFrame(TraceStream *stream)
+{
+    TraceFrame frame;
+    frame.offset = 0;
+    frame.size = 0;
+    frame.rawSize = stream->frameRaw;
+    frame.records = stream->frameRecords;
+    frame.firstBlock = stream->frameFirstBlock;
+    frame.lastBlock = stream->frameFirstBlock == UINT64_MAX ? UINT64_MAX : stream->previousBlock;
+    stream->frameNumber++;
+    stream->frameRaw = 0;
+    stream->frameRecords = 0;
+    stream->frameFirstBlock = UINT64_MAX;
+    stream->previousBlock = 0;
+    stream->previousLoad = 0;
+    stream->previousStore = 0;
+    return frame;
+}
+
+/// <summary>
+/// Adds the frame the compressor just ended to the index and starts the next compressed frame, unless the stream ends.
+/// </summary>
+static void EndFrame(TraceStream *stream, const TraceFrame *frame, bool restart)
+{
+    if (!stream->indexFailed && stream->frameCount == stream->frameCapacity)
+    {
+        uint64_t capacity = stream->frameCapacity == 0 ? 64 : stream->frameCapacity * 2;
+        TraceFrame *frames = (TraceFrame *)realloc(stream->frames, capacity * sizeof(TraceFrame));
+        if (frames == NULL)
+        {
+            //without its index the trace can still be read front to back
+            fprintf(stderr, "Failed to grow the trace frame index\n");
+            free(stream->frames);
+            stream->frames = NULL;
+            stream->indexFailed = true;
+        }
+        else
+        {
+            stream->frames = frames;
+            stream->frameCapacity = capacity;
+        }
+    }
+    if (!stream->indexFailed)
+    {
+        TraceFrame *entry = &stream->frames[stream->frameCount++];
+        *entry = *frame;
+        entry->offset = stream->frameStart;
+        entry->size = stream->written - stream->frameStart;
+    }
+    stream->frameStart = stream->written;
+    if (!restart)
+    {
+        return;
+    }
+    switch (TraceCodec)
+    {
+#ifdef ATLAS_LZ4
+        case TraceCodecLz4:
+            BeginLz4(stream);
+            break;
+#endif
+        case TraceCodecZlib:
+            deflateReset(&stream->strm);
+            break;
+        default:
+            //a finished zstd frame is followed by a new one on the next call
+            break;
+    }
+}
+
+/// <summary>
+/// Writes the frame index and the trailer of a framed trace.
+/// </summary>
+static void WriteIndex(TraceStream *stream)
+{
+    if (TraceFrameSize == 0 || stream->indexFailed)
+    {
+        return;
+    }
+    WriteOutput(stream, (uint8_t *)stream->frames, stream->frameCount * sizeof(TraceFrame));
+    uint8_t trailer[TRACE_TRAILER_SIZE] = {0};
+    memcpy(trailer, &stream->frameCount, sizeof(uint64_t));
+    memcpy(trailer + sizeof(uint64_t), TRACE_INDEX_MAGIC, strlen(TRACE_INDEX_MAGIC));
+    WriteOutput(stream, trailer, TRACE_TRAILER_SIZE);
+}
+
+/// <summary>
+/// Ends the compressed stream, writes the frame index and closes the file. Streams of exited threads are released.
+/// The others are kept, as their threads may still be running.
+/// </summary>
+static void EndStream(TraceStream *stream)
+{
+    switch (TraceCodec)
+    {
+#ifdef ATLAS_ZSTD
+        case TraceCodecZstd:
+            ZSTD_freeCCtx(stream->zstd);
+            break;
+#endif
+#ifdef ATLAS_LZ4
+        case TraceCodecLz4:
+            LZ4F_freeCompressionContext(stream->lz4);
+            break;
+#endif
+        case TraceCodecNone:
+            break;
+        default:
+            deflateEnd(&stream->strm);
+            break;
+    }
+    WriteIndex(stream);
+    free(stream->frames);
+    CloseOutput(stream);
+#ifdef _WIN32
+    _aligned_free(stream->stage);
+#else
+    free(stream->stage);
+#endif
+    if (stream->release)
+    {
+        free(stream);
+    }
+}
+
+#ifndef _WIN32
+/// <summary>
+/// Body of the writer thread. Compresses full buffers in submission order and returns them to the pool.
+/// </summary>
+static void *TraceWriter(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&bufferLock);
+    while (true)
+    {
+        while (fullHead == NULL && !writerClosing)
+        {
+            pthread_cond_wait(&bufferFilled, &bufferLock);
+        }
+        if (fullHead == NULL)
+        {
+            break;
+        }
+        TraceBuffer *buffer = fullHead;
+        fullHead = buffer->next;
+        if (fullHead == NULL)
+        {
+            fullTail = NULL;
+        }
+        pthread_mutex_unlock(&bufferLock);
+
+        CompressBuffer(buffer->stream, buffer->data, buffer->size, buffer->finish || buffer->endFrame);
+        if (buffer->endFrame)
+        {
+            EndFrame(buffer->stream, &buffer->frame, !buffer->finish);
+        }
+        if (buffer->finish)
+        {
+            EndStream(buffer->stream);
+        }
+
+        pthread_mutex_lock(&bufferLock);
+        buffer->next = freeBuffers;
+        freeBuffers = buffer;
+        pthread_cond_signal(&bufferFreed);
+    }
+    pthread_mutex_unlock(&bufferLock);
+    return NULL;
+}
+
+/// <summary>
+/// Hands the buffer of the stream to the writer thread, with the index entry of the frame it ends if any.
+/// Unless the stream is finished, takes a free buffer from the pool, waiting if there is none.
+/// </summary>
+static void SubmitBuffer(TraceStream *stream, bool finish, const TraceFrame *frame)
+{
+    TraceBuffer *buffer = stream->current;
+    buffer->stream = stream;
+    buffer->size = stream->index;
+    buffer->finish = finish;
+    buffer->endFrame = frame != NULL;
+    if (frame != NULL)
+    {
+        buffer->frame = *frame;
+    }
+    buffer->next = NULL;
+    pthread_mutex_lock(&bufferLock);
+    if (fullTail == NULL)
+    {
+        fullHead = buffer;
+    }
+    else
+    {
+        fullTail->next = buffer;
+    }
+    fullTail = buffer;
+    buffersSubmitted++;
+    pthread_cond_signal(&bufferFilled);
+    if (finish)
+    {
+        pthread_mutex_unlock(&bufferLock);
+        return;
+    }
+    if (freeBuffers == NULL)
+    {
+        struct timespec start;
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (freeBuffers == NULL)
+        {
+            pthread_cond_wait(&bufferFreed, &bufferLock);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        producerWaits++;
+        producerWaitNs += (uint64_t)((end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec));
+    }
+    stream->current = freeBuffers;
+    freeBuffers = freeBuffers->next;
+    pthread_mutex_unlock(&bufferLock);
+    stream->buffer = stream->current->data;
+}
+
+/// <summary>
+/// Fills the buffer pool and starts the writer thread. Falls back to synchronous writes on failure.
+/// Every stream brings its own buffer, the TRACE_BUFFERS - 1 spare buffers of the pool are shared by all threads.
+/// </summary>
+static void StartWriter()
+{
+    char *tb = getenv("TRACE_BUFFERS");
+    TraceBufferCount = tb != NULL ? (unsigned int)atoi(tb) : TRACE_DEFAULT_BUFFERS;
+    if (TraceBufferCount < 2)
+    {
+        TraceBufferCount = 2;
+    }
+    for (unsigned int i = 1; i < TraceBufferCount; i++)
+    {
+        TraceBuffer *buffer = (TraceBuffer *)malloc(sizeof(TraceBuffer));
+        if (buffer == NULL)
+        {
+            break;
+        }
+        buffer->next = freeBuffers;
+        freeBuffers = buffer;
+    }
+    if (freeBuffers == NULL || pthread_create(&writerThread, NULL, TraceWriter, NULL) != 0)
+    {
+        return;
+    }
+    TraceAsync = true;
+}
+
+/// <summary>
+/// Drains the queue of the writer thread and joins it.
+/// </summary>
+static void StopWriter()
+{
+    pthread_mutex_lock(&bufferLock);
+    writerClosing = true;
+    pthread_cond_signal(&bufferFilled);
+    pthread_mutex_unlock(&bufferLock);
+    pthread_join(writerThread, NULL);
+    TraceAsync = false;
+    if (getenv("TRACE_STATS") != NULL)
+    {
+        fprintf(stderr, "Trace writer: %lu buffers submitted, producers waited %lu times for %.3f ms\n", (unsigned long)buffersSubmitted, (unsigned long)producerWaits, (double)producerWaitNs / 1e6);
+    }
+}
+#endif
+
+/// <summary>
+/// Appends a LEB128 varint to the buffer of the stream. The caller must have reserved the space.
+/// </summary>
+static inline void WriteVarint(TraceStream *stream, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        stream->buffer[stream->index++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    stream->buffer[stream->index++] = (uint8_t)value;
+}
+
+/// <summary>
+/// Compresses or submits the buffer of the stream and starts over with an empty one.
+/// A buffer that ends at a record boundary also ends the frame once the frame is large enough, the next buffer then starts with a frame record.
+/// </summary>
+static void FlushStream(TraceStream *stream, bool boundary)
+{
+    stream->frameRaw += stream->index;
+    bool cut = boundary && TraceFrameSize != 0 && stream->frameRaw >= TraceFrameSize;
+    TraceFrame frame;
+    if (cut)
+    {
+        frame = TakeFrame(stream);
+    }
+#ifndef _WIN32
+    if (TraceAsync)
+    {
+        SubmitBuffer(stream, false, cut ? &frame : NULL);
+    }
+    else
+#endif
+    {
+        CompressBuffer(stream, stream->buffer, stream->index, cut);
+        if (cut)
+        {
+            EndFrame(stream, &frame, true);
+        }
+    }
+    stream->index = 0;
+    if (cut)
+    {
+        stream->buffer[stream->index++] = TraceOpFrame;
+        WriteVarint(stream, stream->frameNumber);
+    }
+}
+
+/// <summary>
+/// Flushes what is left in the buffer of the stream and ends its compressed stream.
+/// </summary>
+static void FinishStream(TraceStream *stream, bool release)
+{
+    stream->release = release;
+    stream->frameRaw += stream->index;
+    TraceFrame frame = TakeFrame(stream);
+#ifndef _WIN32
+    if (TraceAsync)
+    {
+        SubmitBuffer(stream, true, TraceFrameSize != 0 ? &frame : NULL);
+        return;
+    }
+#endif
+    CompressBuffer(stream, stream->buffer, stream->index, true);
+    if (TraceFrameSize != 0)
+    {
+        EndFrame(stream, &frame, false);
+    }
+    if (release)
+    {
+        free(stream->buffer);
+    }
+    EndStream(stream);
+}
+
+static void WriteStreamTo(TraceStream *stream, const uint8_t *input, size_t size)
+{
+    while (stream->index + size >= BUFSIZE)
+    {
+        size_t part = BUFSIZE - stream->index - 1;
+        memcpy(stream->buffer + stream->index, input, part);
+        stream->index += (unsigned int)part;
+        input += part;
+        size -= part;
+        FlushStream(stream, false);
+    }
+    memcpy(stream->buffer + stream->index, input, size);
+    stream->index += (unsigned int)size;
+}
+
+/// <summary>
+/// Flushes the buffer of the stream if a record of the given size would not fit. Every binary record starts with this.
+/// </summary>
+static inline void ReserveStream(TraceStream *stream, size_t size)
+{
+    if (stream->index + size >= BUFSIZE)
+    {
+        FlushStream(stream, true);
+    }
+    stream->frameRecords++;
+}
+
+/// <summary>
+/// Appends the zigzag encoded difference between current and previous to the buffer of the stream.
+/// </summary>
+static inline void WriteDelta(TraceStream *stream, uint64_t current, uint64_t previous)
+{
+    int64_t delta = (int64_t)(current - previous);
+    WriteVarint(stream, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+/// <summary>
+/// Appends an opcode followed by a length prefixed byte string to the buffer of the stream.
+/// </summary>
+static void WriteBytesRecord(TraceStream *stream, uint8_t op, const uint8_t *data, size_t size)
+{
+    ReserveStream(stream, TRACE_MAX_RECORD);
+    stream->buffer[stream->index++] = op;
+    WriteVarint(stream, size);
+    WriteStreamTo(stream, data, size);
+}
+
+/// <summary>
+/// Writes a skip record for the blocks the current sampling gap left out.
+/// </summary>
+static void WriteSkip(TraceStream *stream)
+{
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        char fin[64];
+        sprintf(fin, "Skip:%#lX\n", stream->sampleSkipped);
+        WriteStreamTo(stream, (uint8_t *)fin, strlen(fin));
+    }
+    else
+    {
+        ReserveStream(stream, TRACE_MAX_RECORD);
+        stream->buffer[stream->index++] = TraceOpSkip;
+        WriteVarint(stream, stream->sampleSkipped);
+    }
+    stream->sampleSkipped = 0;
+}
 
-FILE *myfile;
+/// <summary>
+/// Allocates the stream of a thread, opens its file and writes the trace header. Returns NULL on failure.
+/// </summary>
+static TraceStream *CreateStream(unsigned int thread)
+{
+    TraceStream *stream = (TraceStream *)calloc(1, sizeof(TraceStream));
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+    stream->thread = thread;
+    stream->samplePhase = TraceSampleOn;
+    stream->frameFirstBlock = UINT64_MAX;
+#ifndef _WIN32
+    if (TraceAsync)
+    {
+        stream->current = (TraceBuffer *)malloc(sizeof(TraceBuffer));
+        stream->buffer = stream->current != NULL ? stream->current->data : NULL;
+    }
+    else
+#endif
+    {
+        stream->buffer = (uint8_t *)malloc(BUFSIZE);
+    }
+#ifdef _WIN32
+    stream->stage = (uint8_t *)_aligned_malloc(STAGESIZE, STAGEALIGN);
+#else
+    if (posix_memalign((void **)&stream->stage, STAGEALIGN, STAGESIZE) != 0)
+    {
+        stream->stage = NULL;
+    }
+#endif
+    if (thread == 0)
+    {
+        stream->fd = OpenOutput(TraceFilename);
+    }
+    else
+    {
+        char name[strlen(TraceFilename) + 16];
+        sprintf(name, "%s.%u", TraceFilename, thread);
+        stream->fd = OpenOutput(name);
+    }
+    if (stream->buffer == NULL || stream->stage == NULL || stream->fd < 0 || !InitCodec(stream))
+    {
+        if (stream->fd >= 0)
+        {
+#ifdef _WIN32
+            _close(stream->fd);
+#else
+            close(stream->fd);
+#endif
+        }
+#ifdef _WIN32
+        _aligned_free(stream->stage);
+#else
+        free(stream->stage);
+#endif
+        free(stream->current != NULL ? (void *)stream->current : (void *)stream->buffer);
+        free(stream);
+        return NULL;
+    }
+    char header[32];
+    sprintf(header, "TraceVersion:%d\n", TraceVersion);
+    WriteStreamTo(stream, (uint8_t *)header, strlen(header));
 
-//trace functions
-z_stream strm_DashTracer;
+    LockStreams();
+    stream->next = traceStreams;
+    traceStreams = stream;
+    UnlockStreams();
+    return stream;
+}
 
-int TraceCompressionLevel;
-char *TraceFilename;
 /// <summary>
-/// The maximum ammount of bytes to store in a buffer before flushing it.
+/// Removes the stream from the list of open streams. Returns false if closing the trace already took it.
 /// </summary>
-#define BUFSIZE 128 * 1024
-unsigned int bufferIndex = 0;
-uint8_t temp_buffer[BUFSIZE];
-uint8_t storeBuffer[BUFSIZE];
+static bool UnregisterStream(TraceStream *stream)
+{
+    bool found = false;
+    LockStreams();
+    for (TraceStream **entry = &traceStreams; *entry != NULL; entry = &(*entry)->next)
+    {
+        if (*entry == stream)
+        {
+            *entry = stream->next;
+            found = true;
+            break;
+        }
+    }
+    UnlockStreams();
+    return found;
+}
 
-void WriteStream(char *input)
+#ifndef _WIN32
+/// <summary>
+/// Finishes the stream of a thread when the thread exits.
+/// </summary>
+static void ThreadExit(void *arg)
 {
-    size_t size = strlen(input);
-    if (bufferIndex + size >= BUFSIZE)
+    TraceStream *stream = (TraceStream *)arg;
+    traceStream = NULL;
+    traceFinished = true;
+    //a later stream may be allocated at the same address and must still write its sequence record
+    TraceStream *expected = stream;
+    atomic_compare_exchange_strong(&lastWriter, &expected, NULL);
+    if (UnregisterStream(stream))
     {
-        BufferData();
+        //a trailing gap is recorded as well, so the skipped blocks add up
+        if (stream->sampleSkipped != 0)
+        {
+            WriteSkip(stream);
+        }
+        FinishStream(stream, true);
     }
-    memcpy(storeBuffer + bufferIndex, input, size);
-    bufferIndex += size;
 }
+#endif
 
-///Modified from https://stackoverflow.com/questions/4538586/how-to-compress-a-buffer-with-zlib
-void BufferData()
+/// <summary>
+/// Writes a sequence record to the stream, claiming the next number of the global sequence.
+/// </summary>
+static void WriteSequence(TraceStream *stream)
+{
+    atomic_store_explicit(&lastWriter, stream, memory_order_relaxed);
+    uint64_t sequence = atomic_fetch_add(&traceSequence, 1);
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        char fin[64];
+        sprintf(fin, "Sequence:%#lX\n", sequence);
+        WriteStreamTo(stream, (uint8_t *)fin, strlen(fin));
+        return;
+    }
+    ReserveStream(stream, TRACE_MAX_RECORD);
+    stream->buffer[stream->index++] = TraceOpSequence;
+    WriteVarint(stream, sequence);
+}
+
+/// <summary>
+/// Returns the stream of the calling thread, creating it on the first event of the thread, and marks it as being written.
+/// Returns NULL when the event should be dropped because the trace is not open. Every event that got a stream ends with ReleaseStream.
+/// </summary>
+static inline TraceStream *ThreadStream()
+{
+    if (!atomic_load_explicit(&traceOpen, memory_order_relaxed))
+    {
+        return NULL;
+    }
+    TraceStream *stream = traceStream;
+    if (stream == NULL)
+    {
+        if (traceFinished)
+        {
+            return NULL;
+        }
+        stream = CreateStream(atomic_fetch_add(&threadCount, 1));
+        if (stream == NULL)
+        {
+            traceFinished = true;
+            return NULL;
+        }
+        traceStream = stream;
+#ifndef _WIN32
+        pthread_setspecific(streamKey, stream);
+#endif
+    }
+    //the flag is set before the trace is seen open, so CloseFile either sees the flag or this thread sees the trace closed
+    atomic_store(&stream->writing, true);
+    if (!atomic_load(&traceOpen))
+    {
+        atomic_store_explicit(&stream->writing, false, memory_order_release);
+        return NULL;
+    }
+    return stream;
+}
+
+/// <summary>
+/// Ends the event the calling thread writes to the stream, after which closing the trace may finish the stream.
+/// </summary>
+static inline void ReleaseStream(TraceStream *stream)
+{
+    atomic_store_explicit(&stream->writing, false, memory_order_release);
+}
+
+/// <summary>
+/// Counts an event of the stream. At the end of a batch writes a sequence record if another thread claimed a number since the stream did.
+/// </summary>
+static inline void SequenceStream(TraceStream *stream)
+{
+    if (stream->sequenceLeft != 0)
+    {
+        stream->sequenceLeft--;
+        return;
+    }
+    stream->sequenceLeft = TraceSequenceEvents - 1;
+    if (atomic_load_explicit(&lastWriter, memory_order_relaxed) != stream)
+    {
+        WriteSequence(stream);
+    }
+}
+
+/// <summary>
+/// Returns the stream the calling thread writes its next event to, after the sequence record if one is due.
+/// </summary>
+static inline TraceStream *CurrentStream()
 {
-    strm_DashTracer.next_in = storeBuffer;
-    strm_DashTracer.avail_in = bufferIndex;
-    strm_DashTracer.next_out = temp_buffer;
-    strm_DashTracer.avail_out = BUFSIZE;
-    while (strm_DashTracer.avail_in != 0)
+    TraceStream *stream = ThreadStream();
+    if (stream != NULL)
     {
-        deflate(&strm_DashTracer, Z_NO_FLUSH);
+        SequenceStream(stream);
+    }
+    return stream;
+}
 
-        if (strm_DashTracer.avail_out == 0)
+/// <summary>
+/// Like CurrentStream, but returns NULL for events that fall into a gap of a sampled trace.
+/// Phases advance on block entries, the first event after a gap is preceded by a skip record.
+/// </summary>
+static inline TraceStream *SampledStream(bool blockEntry)
+{
+    if (TraceSampleOff == 0)
+    {
+        return CurrentStream();
+    }
+    TraceStream *stream = ThreadStream();
+    if (stream == NULL)
+    {
+        return NULL;
+    }
+    if (blockEntry)
+    {
+        if (stream->samplePhase == 0)
         {
-            for (int i = 0; i < BUFSIZE; i++)
-            {
-                fputc(temp_buffer[i], myfile);
-            }
-            strm_DashTracer.next_out = temp_buffer;
-            strm_DashTracer.avail_out = BUFSIZE;
+            stream->sampleSkipping = !stream->sampleSkipping;
+            stream->samplePhase = stream->sampleSkipping ? TraceSampleOff : TraceSampleOn;
+        }
+        stream->samplePhase--;
+        if (stream->sampleSkipping)
+        {
+            stream->sampleSkipped++;
         }
     }
-    for (uint32_t i = 0; i < BUFSIZE - strm_DashTracer.avail_out; i++)
+    if (stream->sampleSkipping)
+    {
+        ReleaseStream(stream);
+        return NULL;
+    }
+    SequenceStream(stream);
+    if (stream->sampleSkipped != 0)
+    {
+        WriteSkip(stream);
+    }
+    return stream;
+}
+
+void WriteStream(char *input)
+{
+    WriteStreamBytes((uint8_t *)input, strlen(input));
+}
+
+void WriteStreamBytes(const uint8_t *input, size_t size)
+{
+    TraceStream *stream = CurrentStream();
+    if (stream == NULL)
+    {
+        return;
+    }
+    WriteStreamTo(stream, input, size);
+    ReleaseStream(stream);
+}
+
+void BufferData()
+{
+    TraceStream *stream = CurrentStream();
+    if (stream == NULL)
     {
-        fputc(temp_buffer[i], myfile);
+        return;
     }
-    strm_DashTracer.next_out = temp_buffer;
-    strm_DashTracer.avail_out = BUFSIZE;
-    bufferIndex = 0;
+    FlushStream(stream, true);
+    ReleaseStream(stream);
 }
 
 void Write(char *inst, int line, int block, uint64_t func)
@@ -70,11 +1223,11 @@ void Write(char *inst, int line, int block, uint64_t func)
 #else
     sprintf(suffix, ";line:%d;block:%d;function:%lu\n", line, block, func);
 #endif
-    size_t size = strlen(inst) + strlen(suffix);
+    size_t size = strlen(inst) + strlen(suffix) + 1;
     char fin[size];
     strcpy(fin, inst);
     strncat(fin, suffix, 128);
-    WriteStream(fin);
+    WriteText(fin);
 }
 
 void WriteAddress(char *inst, int line, int block, uint64_t func, char *address)
@@ -85,12 +1238,67 @@ void WriteAddress(char *inst, int line, int block, uint64_t func, char *address)
 #else
     sprintf(suffix, ";line:%d;block:%d;function:%lu;address:%lu\n", line, block, func, (uint64_t)address);
 #endif
-    size_t size = strlen(inst) + strlen(suffix);
+    size_t size = strlen(inst) + strlen(suffix) + 1;
     char fin[size];
 
     strcpy(fin, inst);
     strncat(fin, suffix, 128);
-    WriteStream(fin);
+    WriteText(fin);
+}
+
+void WriteText(char *line)
+{
+    TraceStream *stream = CurrentStream();
+    if (stream == NULL)
+    {
+        return;
+    }
+    size_t size = strlen(line);
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        WriteStreamTo(stream, (uint8_t *)line, size);
+    }
+    else
+    {
+        //the binary record carries the line without its terminator
+        if (size > 0 && line[size - 1] == '\n')
+        {
+            size--;
+        }
+        WriteBytesRecord(stream, TraceOpText, (uint8_t *)line, size);
+    }
+    ReleaseStream(stream);
+}
+
+/// <summary>
+/// Picks the run ID of the trace. It only has to differ between runs that write files of the same name.
+/// </summary>
+static uint16_t NewRun()
+{
+    uint64_t seed = (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ULL ^ (uint64_t)clock() ^ (uint64_t)(uintptr_t)&seed;
+#ifndef _WIN32
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    seed ^= (uint64_t)now.tv_nsec * 0x9E3779B97F4A7C15ULL ^ (uint64_t)getpid();
+#endif
+    uint16_t run = (uint16_t)(seed ^ seed >> 16 ^ seed >> 32 ^ seed >> 48);
+    return run != 0 ? run : 1;
+}
+
+/// <summary>
+/// Removes the files of the other threads of an earlier trace of the same name, which readers would otherwise merge into this one.
+/// </summary>
+static void RemoveThreadFiles()
+{
+    char name[strlen(TraceFilename) + 16];
+    for (unsigned int thread = 1;; thread++)
+    {
+        sprintf(name, "%s.%u", TraceFilename, thread);
+        if (remove(name) != 0)
+        {
+            break;
+        }
+    }
 }
 
 void OpenFile()
@@ -105,10 +1313,66 @@ void OpenFile()
     {
         TraceCompressionLevel = 5;
     }
-    strm_DashTracer.zalloc = Z_NULL;
-    strm_DashTracer.zfree = Z_NULL;
-    strm_DashTracer.opaque = Z_NULL;
-    deflateInit(&strm_DashTracer, TraceCompressionLevel);
+    char *tv = getenv("TRACE_VERSION");
+    if (tv != NULL && atoi(tv) == TRACE_VERSION_TEXT)
+    {
+        TraceVersion = TRACE_VERSION_TEXT;
+    }
+    else
+    {
+        TraceVersion = TRACE_VERSION_BINARY;
+    }
+    char *tc = getenv("TRACE_CODEC");
+    TraceCodec = TraceCodecZlib;
+    if (tc != NULL && strcmp(tc, "none") == 0)
+    {
+        TraceCodec = TraceCodecNone;
+    }
+    else if (tc != NULL && strcmp(tc, "zstd") == 0)
+    {
+#ifdef ATLAS_ZSTD
+        TraceCodec = TraceCodecZstd;
+#else
+        fprintf(stderr, "Tracer was built without zstd, falling back to zlib\n");
+#endif
+    }
+    else if (tc != NULL && strcmp(tc, "lz4") == 0)
+    {
+#ifdef ATLAS_LZ4
+        TraceCodec = TraceCodecLz4;
+#else
+        fprintf(stderr, "Tracer was built without lz4, falling back to zlib\n");
+#endif
+    }
+    else if (tc != NULL && strcmp(tc, "zlib") != 0)
+    {
+        fprintf(stderr, "Unknown TRACE_CODEC %s, falling back to zlib\n", tc);
+    }
+    char *tct = getenv("TRACE_CODEC_THREADS");
+    TraceCodecThreads = tct != NULL ? atoi(tct) : TRACE_DEFAULT_CODEC_THREADS;
+    char *tso = getenv("TRACE_SAMPLE_ON");
+    char *tsf = getenv("TRACE_SAMPLE_OFF");
+    TraceSampleOn = tso != NULL ? strtoull(tso, NULL, 10) : 0;
+    TraceSampleOff = tsf != NULL ? strtoull(tsf, NULL, 10) : 0;
+    if (TraceSampleOn == 0)
+    {
+        TraceSampleOff = 0;
+    }
+    char *tfs = getenv("TRACE_FRAME_SIZE");
+    TraceFrameSize = (tfs != NULL ? strtoull(tfs, NULL, 10) : TRACE_DEFAULT_FRAME_SIZE) * 1024 * 1024;
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        //text lines may be split across buffers, so there is no safe place to cut them
+        TraceFrameSize = 0;
+    }
+    char *tse = getenv("TRACE_SEQUENCE_EVENTS");
+    TraceSequenceEvents = tse != NULL ? strtoull(tse, NULL, 10) : TRACE_DEFAULT_SEQUENCE_EVENTS;
+    if (TraceSequenceEvents == 0)
+    {
+        TraceSequenceEvents = 1;
+    }
+    char *td = getenv("TRACE_DIRECT");
+    TraceDirect = td != NULL && atoi(td) != 0;
     char *tfn = getenv("TRACE_NAME");
     if (tfn != NULL)
     {
@@ -118,39 +1382,90 @@ void OpenFile()
     {
         TraceFilename = "raw.trc";
     }
-
-    myfile = fopen(TraceFilename, "w");
-    WriteStream("TraceVersion:3\n");
+    TraceRun = NewRun();
+    RemoveThreadFiles();
+#ifndef _WIN32
+    pthread_key_create(&streamKey, ThreadExit);
+    char *ta = getenv("TRACE_ASYNC");
+    if (ta != NULL && atoi(ta) != 0)
+    {
+        StartWriter();
+    }
+#endif
+    //the opening thread writes the main trace, it needs no sequence record until another thread has written
+    traceStream = CreateStream(0);
+    if (traceStream == NULL)
+    {
+        return;
+    }
+#ifndef _WIN32
+    pthread_setspecific(streamKey, traceStream);
+#endif
+    atomic_store(&lastWriter, traceStream);
+    atomic_store(&traceOpen, true);
 }
 
 void CloseFile()
 {
-    strm_DashTracer.next_in = storeBuffer;
-    strm_DashTracer.avail_in = bufferIndex;
-    strm_DashTracer.next_out = temp_buffer;
-    strm_DashTracer.avail_out = BUFSIZE;
-    deflate(&strm_DashTracer, Z_FINISH);
-    for (uint32_t i = 0; i < BUFSIZE - strm_DashTracer.avail_out; i++)
+    //threads that are still running drop their events from here on
+    atomic_store(&traceOpen, false);
+    LockStreams();
+    TraceStream *stream = traceStreams;
+    traceStreams = NULL;
+    UnlockStreams();
+    while (stream != NULL)
+    {
+        TraceStream *next = stream->next;
+        //a thread that saw the trace open before may still be writing an event
+        while (atomic_load_explicit(&stream->writing, memory_order_acquire))
+        {
+        }
+        if (stream->sampleSkipped != 0)
+        {
+            WriteSkip(stream);
+        }
+        FinishStream(stream, false);
+        stream = next;
+    }
+#ifndef _WIN32
+    if (TraceAsync)
     {
-        fputc(temp_buffer[i], myfile);
+        StopWriter();
     }
-
-    deflateEnd(&strm_DashTracer);
-    //fclose(myfile); //breaks occasionally for some reason. Likely a glibc error.
+#endif
 }
 
 void LoadDump(void *address)
 {
-    char fin[128];
-    sprintf(fin, "LoadAddress:%#lX\n", (uint64_t)address);
-    WriteStream(fin);
+    TraceStream *stream = SampledStream(false);
+    if (stream == NULL)
+    {
+        return;
+    }
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        char fin[128];
+        sprintf(fin, "LoadAddress:%#lX\n", (uint64_t)address);
+        WriteStreamTo(stream, (uint8_t *)fin, strlen(fin));
+    }
+    else
+    {
+        ReserveStream(stream, TRACE_MAX_RECORD);
+        stream->buffer[stream->index++] = TraceOpLoadAddress;
+        WriteDelta(stream, (uint64_t)address, stream->previousLoad);
+        stream->previousLoad = (uint64_t)address;
+    }
+    ReleaseStream(stream);
 }
-void DumpLoadValue(void *MemValue, int size)
+
+/// <summary>
+/// Writes the bytes of a memory value as a hex string, the text encoding of LoadValue and StoreValue.
+/// </summary>
+static void WriteValueText(TraceStream *stream, char *key, uint8_t *bitwisePrint, int size)
 {
     char fin[128];
-    uint8_t *bitwisePrint = (uint8_t *)MemValue;
-    sprintf(fin, "LoadValue:");
-    WriteStream(fin);
+    sprintf(fin, "%s:", key);
+    WriteStreamTo(stream, (uint8_t *)fin, strlen(fin));
     for (int i = 0; i < size; i++)
     {
         if (i == 0)
@@ -161,67 +1476,132 @@ void DumpLoadValue(void *MemValue, int size)
         {
             sprintf(fin, "%02X", bitwisePrint[i]);
         }
-        WriteStream(fin);
+        WriteStreamTo(stream, (uint8_t *)fin, strlen(fin));
+    }
+    WriteStreamTo(stream, (uint8_t *)"\n", 1);
+}
+
+void DumpLoadValue(void *MemValue, int size)
+{
+    TraceStream *stream = SampledStream(false);
+    if (stream == NULL)
+    {
+        return;
+    }
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        WriteValueText(stream, "LoadValue", (uint8_t *)MemValue, size);
+    }
+    else
+    {
+        WriteBytesRecord(stream, TraceOpLoadValue, (uint8_t *)MemValue, (size_t)size);
     }
-    sprintf(fin, "\n");
-    WriteStream(fin);
+    ReleaseStream(stream);
 }
+
 void StoreDump(void *address)
 {
-    char fin[128];
-    sprintf(fin, "StoreAddress:%#lX\n", (uint64_t)address);
-    WriteStream(fin);
+    TraceStream *stream = SampledStream(false);
+    if (stream == NULL)
+    {
+        return;
+    }
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        char fin[128];
+        sprintf(fin, "StoreAddress:%#lX\n", (uint64_t)address);
+        WriteStreamTo(stream, (uint8_t *)fin, strlen(fin));
+    }
+    else
+    {
+        ReserveStream(stream, TRACE_MAX_RECORD);
+        stream->buffer[stream->index++] = TraceOpStoreAddress;
+        WriteDelta(stream, (uint64_t)address, stream->previousStore);
+        stream->previousStore = (uint64_t)address;
+    }
+    ReleaseStream(stream);
 }
 
 void DumpStoreValue(void *MemValue, int size)
 {
-    char fin[128];
-    uint8_t *bitwisePrint = (uint8_t *)MemValue;
-    sprintf(fin, "StoreValue:");
-    WriteStream(fin);
-    for (int i = 0; i < size; i++)
+    TraceStream *stream = SampledStream(false);
+    if (stream == NULL)
     {
-        if (i == 0)
+        return;
+    }
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        WriteValueText(stream, "StoreValue", (uint8_t *)MemValue, size);
+    }
+    else
+    {
+        WriteBytesRecord(stream, TraceOpStoreValue, (uint8_t *)MemValue, (size_t)size);
+    }
+    ReleaseStream(stream);
+}
+
+void BB_ID_Dump(uint64_t block, bool enter)
+{
+    TraceStream *stream = SampledStream(enter);
+    if (stream == NULL)
+    {
+        return;
+    }
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        char fin[128];
+        if (enter)
         {
-            sprintf(fin, "0X%02X", bitwisePrint[i]);
+            sprintf(fin, "BBEnter:%#lX\n", block);
         }
         else
         {
-            sprintf(fin, "%02X", bitwisePrint[i]);
+            sprintf(fin, "BBExit:%#lX\n", block);
+        }
+        WriteStreamTo(stream, (uint8_t *)fin, strlen(fin));
+    }
+    else
+    {
+        ReserveStream(stream, TRACE_MAX_RECORD);
+        if (stream->frameFirstBlock == UINT64_MAX)
+        {
+            stream->frameFirstBlock = block;
         }
-        WriteStream(fin);
+        stream->buffer[stream->index++] = enter ? TraceOpBBEnter : TraceOpBBExit;
+        WriteDelta(stream, block, stream->previousBlock);
+        stream->previousBlock = block;
     }
-    sprintf(fin, "\n");
-    WriteStream(fin);
+    ReleaseStream(stream);
 }
 
-void BB_ID_Dump(uint64_t block, bool enter)
+/// <summary>
+/// Writes a kernel label record. The text encoding is the key followed by the label.
+/// </summary>
+static void WriteLabel(char *key, uint8_t op, char *label)
 {
-    char fin[128];
-    if (enter)
+    TraceStream *stream = CurrentStream();
+    if (stream == NULL)
     {
-        sprintf(fin, "BBEnter:%#lX\n", block);
+        return;
+    }
+    if (TraceVersion == TRACE_VERSION_TEXT)
+    {
+        WriteStreamTo(stream, (uint8_t *)key, strlen(key));
+        WriteStreamTo(stream, (uint8_t *)label, strlen(label));
+        WriteStreamTo(stream, (uint8_t *)"\n", 1);
     }
     else
     {
-        sprintf(fin, "BBExit:%#lX\n", block);
+        WriteBytesRecord(stream, op, (uint8_t *)label, strlen(label));
     }
-    WriteStream(fin);
+    ReleaseStream(stream);
 }
 
 void KernelEnter(char *label)
 {
-    char fin[128];
-    strcpy(fin, "KernelEnter:");
-    strcat(fin, label);
-    strcat(fin, "\n");
-    WriteStream(fin);
+    WriteLabel("KernelEnter:", TraceOpKernelEnter, label);
 }
 void KernelExit(char *label)
 {
-    char fin[128];
-    strcpy(fin, "KernelExit:");
-    strcat(fin, label);
-    strcat(fin, "\n");
-    WriteStream(fin);
+    WriteLabel("KernelExit:", TraceOpKernelExit, label);
 }
@@ -6,4 +6,13 @@ cl::opt<std::string> KernelFilename("k", cl::desc("Specify filename for kernel")
 cl::opt<bool> DumpLoads("DL", cl::desc("Dump load instruction information"), cl::desc("Dump load instruction information"), cl::init(true));
 cl::opt<bool> DumpStores("DS", cl::desc("Dump store instruction information"), cl::desc("Dump store instruction information"), cl::init(true));
 
-cl::opt<std::string> LibraryName("ln", cl::desc("Library Name"), cl::value_desc("Library name"));
\ No newline at end of file
+cl::opt<std::string> LibraryName("ln", cl::desc("Library Name"), cl::value_desc("Library name"));
+
+cl::opt<bool> CountBlocks("BC", cl::desc("Count block executions instead of tracing them"), cl::init(false));
+cl::opt<bool> AtomicCounts("BCA", cl::desc("Increment the block counters atomically"), cl::init(false));
+cl::opt<std::string> EdgeMapFile("em", cl::desc("Specify the edge map filename of the edge profile"), cl::value_desc("edge map filename"), cl::init("edges.json"));
+cl::list<int> KernelIndices("KL", cl::desc("Specify the kernel indices to trace"), cl::value_desc("kernel indices"), cl::CommaSeparated);
+cl::list<std::string> TraceFunctions("TF", cl::desc("Only instrument functions matching these globs"), cl::value_desc("function globs"), cl::CommaSeparated);
+cl::list<std::string> SkipFunctions("XF", cl::desc("Do not instrument functions matching these globs"), cl::value_desc("function globs"), cl::CommaSeparated);
+cl::list<std::string> TraceBlocks("TB", cl::desc("Only instrument blocks in these ID ranges"), cl::value_desc("first-last"), cl::CommaSeparated);
+cl::list<std::string> SkipBlocks("XB", cl::desc("Do not instrument blocks in these ID ranges"), cl::value_desc("first-last"), cl::CommaSeparated);
\ No newline at end of file
@@ -0,0 +1,193 @@
+#include "Passes/EdgeProfile.h"
+#include "AtlasUtil/Annotate.h"
+#include "AtlasUtil/EdgeProfile.h"
+#include "Passes/Annotate.h"
+#include "Passes/CommandArgs.h"
+#include "Passes/Functions.h"
+#include <fstream>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/BlockFrequencyInfo.h>
+#include <llvm/Analysis/BranchProbabilityInfo.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace llvm;
+
+namespace DashTracer::Passes
+{
+    /// <summary>
+    /// Finds where the count of an edge can be taken: the end of a source with a single successor, the start of a target with a single predecessor
+    /// or a block splitting the edge. Returns nullptr if none of them is possible, e.g. for indirectbr and exception edges.
+    /// </summary>
+    static Instruction *EdgeInsertion(BasicBlock *source, BasicBlock *target, bool split)
+    {
+        //a block without successors always leaves through the exit, counting it on entry also covers calls that never return
+        if (target == nullptr)
+        {
+            return source->getFirstInsertionPt() == source->end() ? nullptr : cast<Instruction>(source->getFirstInsertionPt());
+        }
+        if (source->getUniqueSuccessor() == target)
+        {
+            return source->getTerminator();
+        }
+        if (target->getUniquePredecessor() == source && target->getFirstInsertionPt() != target->end())
+        {
+            return cast<Instruction>(target->getFirstInsertionPt());
+        }
+        auto *term = source->getTerminator();
+        if (!(isa<BranchInst>(term) || isa<SwitchInst>(term)) || target->isEHPad())
+        {
+            return nullptr;
+        }
+        if (!split)
+        {
+            return term;
+        }
+        for (unsigned int i = 0; i < term->getNumSuccessors(); i++)
+        {
+            if (term->getSuccessor(i) == target)
+            {
+                auto *splitBlock = SplitCriticalEdge(term, i, CriticalEdgeSplittingOptions().setMergeIdenticalEdges());
+                return splitBlock == nullptr ? nullptr : splitBlock->getTerminator();
+            }
+        }
+        return nullptr;
+    }
+
+    void EdgeProfile::CountEdge(BasicBlock *source, BasicBlock *target, uint64_t counter)
+    {
+        auto *insertion = EdgeInsertion(source, target, true);
+        if (insertion == nullptr)
+        {
+            errs() << "Failed to count edge of " << source->getParent()->getName() << "\n";
+            return;
+        }
+        IRBuilder<> builder(insertion);
+        Value *count = builder.CreateConstInBoundsGEP2_64(edgeCounters, 0, counter);
+        Value *one = ConstantInt::get(Type::getInt64Ty(source->getContext()), 1);
+        if (AtomicCounts)
+        {
+            builder.CreateAtomicRMW(AtomicRMWInst::Add, count, one, AtomicOrdering::Monotonic);
+        }
+        else
+        {
+            Value *value = builder.CreateLoad(count);
+            builder.CreateStore(builder.CreateAdd(value, one), count);
+        }
+    }
+
+    bool EdgeProfile::runOnModule(Module &M)
+    {
+        //source, target (nullptr for the exit) and counter of every counted edge
+        std::vector<std::tuple<BasicBlock *, BasicBlock *, uint64_t>> countedEdges;
+        nlohmann::json edgeMap;
+        uint64_t counters = 0;
+        for (auto &F : M)
+        {
+            if (F.empty())
+            {
+                continue;
+            }
+            auto &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>(F).getBFI();
+            auto &BPI = getAnalysis<BranchProbabilityInfoWrapperPass>(F).getBPI();
+
+            //the virtual edge from the exit back to the entry cannot be counted, so it is always in the tree
+            std::vector<ProfileEdge> edges;
+            std::vector<uint64_t> weights;
+            std::vector<std::pair<BasicBlock *, BasicBlock *>> blocks;
+            edges.push_back({EDGE_PROFILE_EXIT, GetBlockID(&F.getEntryBlock())});
+            weights.push_back(UINT64_MAX);
+            blocks.emplace_back(nullptr, &F.getEntryBlock());
+            for (auto &BB : F)
+            {
+                uint64_t frequency = BFI.getBlockFreq(&BB).getFrequency();
+                if (succ_empty(&BB))
+                {
+                    edges.push_back({GetBlockID(&BB), EDGE_PROFILE_EXIT});
+                    weights.push_back(EdgeInsertion(&BB, nullptr, false) == nullptr ? UINT64_MAX : std::min(frequency, UINT64_MAX - 1));
+                    blocks.emplace_back(&BB, nullptr);
+                    continue;
+                }
+                //duplicate edges of a switch are one edge
+                SmallPtrSet<BasicBlock *, 8> targets;
+                for (auto *succ : successors(&BB))
+                {
+                    if (!targets.insert(succ).second)
+                    {
+                        continue;
+                    }
+                    edges.push_back({GetBlockID(&BB), GetBlockID(succ)});
+                    if (EdgeInsertion(&BB, succ, false) == nullptr)
+                    {
+                        weights.push_back(UINT64_MAX);
+                    }
+                    else
+                    {
+                        weights.push_back(std::min(BPI.getEdgeProbability(&BB, succ).scale(frequency), UINT64_MAX - 1));
+                    }
+                    blocks.emplace_back(&BB, succ);
+                }
+            }
+
+            auto tree = SpanningTree(edges, weights);
+            if (tree.empty())
+            {
+                errs() << "Edges of " << F.getName() << " cannot be counted, skipping it\n";
+                continue;
+            }
+            nlohmann::json functionEdges = nlohmann::json::array();
+            for (size_t i = 0; i < edges.size(); i++)
+            {
+                if (!tree[i])
+                {
+                    edges[i].counter = (int64_t)counters;
+                    countedEdges.emplace_back(blocks[i].first, blocks[i].second, counters++);
+                }
+                functionEdges.push_back({edges[i].source, edges[i].target, edges[i].counter});
+            }
+            edgeMap["Functions"][F.getName().str()] = functionEdges;
+        }
+        edgeMap["Counters"] = counters;
+
+        auto *counterType = ArrayType::get(Type::getInt64Ty(M.getContext()), counters);
+        edgeCounters = new GlobalVariable(M, counterType, false, GlobalValue::InternalLinkage, ConstantAggregateZero::get(counterType), "AtlasEdgeCounts");
+        for (auto &[source, target, counter] : countedEdges)
+        {
+            CountEdge(source, target, counter);
+        }
+
+        //the counters are dumped once at exit
+        DumpEdgeProfile = cast<Function>(M.getOrInsertFunction("DumpEdgeProfile", Type::getVoidTy(M.getContext()), Type::getInt64PtrTy(M.getContext()), Type::getInt64Ty(M.getContext())).getCallee());
+        auto *dumpFunc = Function::Create(FunctionType::get(Type::getVoidTy(M.getContext()), false), GlobalValue::InternalLinkage, "AtlasDumpEdgeCounts", M);
+        IRBuilder<> builder(BasicBlock::Create(M.getContext(), "", dumpFunc));
+        std::vector<Value *> args;
+        args.push_back(builder.CreateConstInBoundsGEP2_64(edgeCounters, 0, 0));
+        args.push_back(ConstantInt::get(Type::getInt64Ty(M.getContext()), counters));
+        builder.CreateCall(DumpEdgeProfile, args);
+        builder.CreateRetVoid();
+        appendToGlobalDtors(M, dumpFunc, 0);
+
+        std::ofstream mapStream(EdgeMapFile);
+        mapStream << edgeMap;
+        mapStream.close();
+        return true;
+    }
+
+    void EdgeProfile::getAnalysisUsage(AnalysisUsage &AU) const
+    {
+        AU.addRequired<DashTracer::Passes::EncodedAnnotate>();
+        AU.addRequired<BlockFrequencyInfoWrapperPass>();
+        AU.addRequired<BranchProbabilityInfoWrapperPass>();
+    }
+
+    char EdgeProfile::ID = 0;
+    static RegisterPass<EdgeProfile> Y("EdgeProfile", "Adds spanning tree edge counters to the binary", true, false);
+} // namespace DashTracer::Passes
@@ -0,0 +1,161 @@
+#include "Passes/Filter.h"
+#include "Passes/CommandArgs.h"
+#include <algorithm>
+#include <fstream>
+#include <llvm/Support/ErrorHandling.h>
+#include <nlohmann/json.hpp>
+
+using namespace llvm;
+
+namespace DashTracer::Passes
+{
+    std::unordered_set<int64_t> ReadKernelBlocks(const std::string &kernelFile, const std::vector<int> &indices)
+    {
+        nlohmann::json j;
+        std::ifstream inputStream(kernelFile);
+        if (!inputStream)
+        {
+            report_fatal_error(Twine("Failed to open kernel file: ") + kernelFile);
+        }
+        inputStream >> j;
+        inputStream.close();
+        std::unordered_set<int64_t> blocks;
+        auto &kernels = j.contains("Kernels") ? j["Kernels"] : j;
+        for (auto &[key, value] : kernels.items())
+        {
+            if (!indices.empty() && std::find(indices.begin(), indices.end(), stoi(key)) == indices.end())
+            {
+                continue;
+            }
+            nlohmann::json kernel;
+            if (value.is_object())
+            {
+                kernel = value["Blocks"];
+            }
+            else if (!value[0].empty() && value[0].is_array())
+            {
+                //embedded layout
+                kernel = value[0];
+            }
+            else
+            {
+                kernel = value;
+            }
+            for (auto block : kernel.get<std::vector<int64_t>>())
+            {
+                blocks.insert(block);
+            }
+        }
+        return blocks;
+    }
+
+    static std::vector<GlobPattern> ParseGlobs(const std::vector<std::string> &globs)
+    {
+        std::vector<GlobPattern> result;
+        for (const auto &glob : globs)
+        {
+            auto pattern = GlobPattern::create(glob);
+            if (!pattern)
+            {
+                report_fatal_error(Twine("Invalid function glob: ") + glob);
+            }
+            result.push_back(*pattern);
+        }
+        return result;
+    }
+
+    /// <summary>
+    /// Parses block ranges of the form "first-last" or a single "block".
+    /// </summary>
+    static std::vector<std::pair<int64_t, int64_t>> ParseRanges(const std::vector<std::string> &ranges)
+    {
+        std::vector<std::pair<int64_t, int64_t>> result;
+        for (const auto &range : ranges)
+        {
+            try
+            {
+                auto dash = range.find('-', 1);
+                if (dash == std::string::npos)
+                {
+                    int64_t block = std::stoll(range);
+                    result.emplace_back(block, block);
+                }
+                else
+                {
+                    result.emplace_back(std::stoll(range.substr(0, dash)), std::stoll(range.substr(dash + 1)));
+                }
+            }
+            catch (std::exception &e)
+            {
+                report_fatal_error(Twine("Invalid block range: ") + range);
+            }
+        }
+        return result;
+    }
+
+    static bool InRanges(const std::vector<std::pair<int64_t, int64_t>> &ranges, int64_t block)
+    {
+        for (const auto &[first, last] : ranges)
+        {
+            if (block >= first && block <= last)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void InstrumentationFilter::Load()
+    {
+        allowFunctions = ParseGlobs(TraceFunctions);
+        denyFunctions = ParseGlobs(SkipFunctions);
+        allowRanges = ParseRanges(TraceBlocks);
+        denyRanges = ParseRanges(SkipBlocks);
+        kernelFilter = !KernelFilename.empty();
+        if (kernelFilter)
+        {
+            std::vector<int> indices(KernelIndices.begin(), KernelIndices.end());
+            if (indices.empty() && KernelIndex.getNumOccurrences() != 0)
+            {
+                indices.push_back(KernelIndex);
+            }
+            kernelBlocks = ReadKernelBlocks(KernelFilename, indices);
+        }
+    }
+
+    bool InstrumentationFilter::Instrument(const Function &F) const
+    {
+        for (const auto &glob : denyFunctions)
+        {
+            if (glob.match(F.getName()))
+            {
+                return false;
+            }
+        }
+        if (allowFunctions.empty())
+        {
+            return true;
+        }
+        for (const auto &glob : allowFunctions)
+        {
+            if (glob.match(F.getName()))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool InstrumentationFilter::Instrument(int64_t block) const
+    {
+        if (InRanges(denyRanges, block))
+        {
+            return false;
+        }
+        if (allowRanges.empty() && !kernelFilter)
+        {
+            return true;
+        }
+        return InRanges(allowRanges, block) || kernelBlocks.find(block) != kernelBlocks.end();
+    }
+} // namespace DashTracer::Passes
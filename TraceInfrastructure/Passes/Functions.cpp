@@ -13,4 +13,6 @@ namespace DashTracer::Passes
     Function *DumpLoadValue;
     Function *fullFunc;
     Function *fullAddrFunc;
+    Function *DumpBlockProfile;
+    Function *DumpEdgeProfile;
 } // namespace DashTracer::Passes
\ No newline at end of file
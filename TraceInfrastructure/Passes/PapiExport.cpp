@@ -2,6 +2,7 @@
 #include "AtlasUtil/Annotate.h"
 #include "Passes/Annotate.h"
 #include "Passes/CommandArgs.h"
+#include "Passes/Filter.h"
 #include "Passes/PapiIO.h"
 #include <fstream>
 #include <iostream>
@@ -24,7 +25,7 @@ using namespace std;
 namespace DashTracer::Passes
 {
 
-    std::vector<uint64_t> kernelBlock;
+    std::unordered_set<int64_t> kernelBlock;
     Function *certOn;
     Function *certOff;
 
@@ -36,13 +37,13 @@ namespace DashTracer::Passes
             auto *block = cast<BasicBlock>(BB);
             std::vector<Instruction *> toRemove;
             auto blockId = GetBlockID(block);
-            bool local = std::find(kernelBlock.begin(), kernelBlock.end(), blockId) != kernelBlock.end();
+            bool local = kernelBlock.find(blockId) != kernelBlock.end();
             bool contInt = false;
             bool contExt = false;
             for (BasicBlock *pred : predecessors(block))
             {
                 auto subId = GetBlockID(pred);
-                if (std::find(kernelBlock.begin(), kernelBlock.end(), subId) != kernelBlock.end())
+                if (kernelBlock.find(subId) != kernelBlock.end())
                 {
                     contInt = true;
                 }
@@ -125,29 +126,7 @@ namespace DashTracer::Passes
         certOn = cast<Function>(M.getOrInsertFunction("CertifyPapiOn", Type::getVoidTy(M.getContext())).getCallee());
         certOff = cast<Function>(M.getOrInsertFunction("CertifyPapiOff", Type::getVoidTy(M.getContext())).getCallee());
 
-        kernelBlock.clear();
-        nlohmann::json j;
-        std::ifstream inputStream(KernelFilename);
-        inputStream >> j;
-        inputStream.close();
-        for (auto &[key, value] : j.items())
-        {
-            string index = key;
-            if (stoi(index) == KernelIndex)
-            {
-                nlohmann::json kernel;
-                if (!value[0].empty() && value[0].is_array())
-                {
-                    //embedded layout
-                    kernel = value[0];
-                }
-                else
-                {
-                    kernel = value;
-                }
-                kernelBlock = kernel.get<vector<uint64_t>>();
-            }
-        }
+        kernelBlock = ReadKernelBlocks(KernelFilename, {KernelIndex});
 
         return false;
     }
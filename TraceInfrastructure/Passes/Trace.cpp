@@ -11,6 +11,7 @@
 #include <llvm/IR/Type.h>
 #include <llvm/Pass.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
 #include <string>
 #include <vector>
 
@@ -18,18 +19,51 @@ using namespace llvm;
 
 namespace DashTracer::Passes
 {
+    void EncodedTrace::CountBlock(BasicBlock *BB, int64_t id)
+    {
+        IRBuilder<> builder(cast<Instruction>(BB->getFirstInsertionPt()));
+        Value *counter = builder.CreateConstInBoundsGEP2_64(blockCounters, 0, (uint64_t)id);
+        Value *one = ConstantInt::get(Type::getInt64Ty(BB->getContext()), 1);
+        if (AtomicCounts)
+        {
+            builder.CreateAtomicRMW(AtomicRMWInst::Add, counter, one, AtomicOrdering::Monotonic);
+        }
+        else
+        {
+            Value *count = builder.CreateLoad(counter);
+            builder.CreateStore(builder.CreateAdd(count, one), counter);
+        }
+    }
+
     bool EncodedTrace::runOnFunction(Function &F)
     {
+        if (!filter.Instrument(F))
+        {
+            return false;
+        }
         for (auto fi = F.begin(); fi != F.end(); fi++)
         {
             auto BB = cast<BasicBlock>(fi);
+            int64_t id = GetBlockID(BB);
+            if (!filter.Instrument(id))
+            {
+                continue;
+            }
+            if (CountBlocks)
+            {
+                //the dump function added by doInitialization has no ID and is not counted
+                if (id >= 0 && (uint64_t)id < blockTotal)
+                {
+                    CountBlock(BB, id);
+                }
+                continue;
+            }
             auto firstInsertion = BB->getFirstInsertionPt();
             auto *firstInst = cast<Instruction>(firstInsertion);
             Value *trueConst = ConstantInt::get(Type::getInt1Ty(BB->getContext()), 1);
             Value *falseConst = ConstantInt::get(Type::getInt1Ty(BB->getContext()), 0);
 
             IRBuilder<> firstBuilder(firstInst);
-            int64_t id = GetBlockID(BB);
             Value *idValue = ConstantInt::get(Type::getInt64Ty(BB->getContext()), (uint64_t)id);
             std::vector<Value *> args;
             args.push_back(idValue);
@@ -75,7 +109,30 @@ namespace DashTracer::Passes
         BB_ID = cast<Function>(M.getOrInsertFunction("BB_ID_Dump", Type::getVoidTy(M.getContext()), Type::getInt64Ty(M.getContext()), Type::getInt1Ty(M.getContext())).getCallee());
         LoadDump = cast<Function>(M.getOrInsertFunction("LoadDump", Type::getVoidTy(M.getContext()), Type::getIntNPtrTy(M.getContext(), 8)).getCallee());
         StoreDump = cast<Function>(M.getOrInsertFunction("StoreDump", Type::getVoidTy(M.getContext()), Type::getIntNPtrTy(M.getContext(), 8)).getCallee());
-        return false;
+        filter.Load();
+        if (!CountBlocks)
+        {
+            return false;
+        }
+        //one counter per block ID, the annotation numbers every block of the module in order
+        blockTotal = 0;
+        for (auto &F : M)
+        {
+            blockTotal += F.size();
+        }
+        auto *counterType = ArrayType::get(Type::getInt64Ty(M.getContext()), blockTotal);
+        blockCounters = new GlobalVariable(M, counterType, false, GlobalValue::InternalLinkage, ConstantAggregateZero::get(counterType), "AtlasBlockCounts");
+        DumpBlockProfile = cast<Function>(M.getOrInsertFunction("DumpBlockProfile", Type::getVoidTy(M.getContext()), Type::getInt64PtrTy(M.getContext()), Type::getInt64Ty(M.getContext())).getCallee());
+        //the counters are dumped once at exit
+        auto *dumpFunc = Function::Create(FunctionType::get(Type::getVoidTy(M.getContext()), false), GlobalValue::InternalLinkage, "AtlasDumpBlockCounts", M);
+        IRBuilder<> builder(BasicBlock::Create(M.getContext(), "", dumpFunc));
+        std::vector<Value *> args;
+        args.push_back(builder.CreateConstInBoundsGEP2_64(blockCounters, 0, 0));
+        args.push_back(ConstantInt::get(Type::getInt64Ty(M.getContext()), blockTotal));
+        builder.CreateCall(DumpBlockProfile, args);
+        builder.CreateRetVoid();
+        appendToGlobalDtors(M, dumpFunc, 0);
+        return true;
     }
 
     void EncodedTrace::getAnalysisUsage(AnalysisUsage &AU) const
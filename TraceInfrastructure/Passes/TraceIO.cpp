@@ -23,6 +23,11 @@ namespace DashTracer
     {
         bool TraceIO::runOnModule(Module &M)
         {
+            //block counts are dumped by the counters themselves, there is no trace to open
+            if (CountBlocks)
+            {
+                return false;
+            }
             appendToGlobalCtors(M, openFunc, 0);
             appendToGlobalDtors(M, closeFunc, 0);
             return true;
@@ -2,6 +2,7 @@
 #include "AtlasUtil/Annotate.h"
 #include "Passes/Annotate.h"
 #include "Passes/CommandArgs.h"
+#include "Passes/Filter.h"
 #include "Passes/Functions.h"
 #include "Passes/TraceMemIO.h"
 #include "llvm/IR/DataLayout.h"
@@ -24,7 +25,7 @@ using namespace std;
 namespace DashTracer::Passes
 {
 
-    std::vector<uint64_t> kernelBlockValue;
+    std::unordered_set<int64_t> kernelBlockValue;
 
     bool EncodedTraceMemory::runOnFunction(Function &F)
     {
@@ -34,7 +35,7 @@ namespace DashTracer::Passes
             auto *block = cast<BasicBlock>(BB);
             auto dl = block->getModule()->getDataLayout();
             int64_t blockId = GetBlockID(block);
-            if (std::find(kernelBlockValue.begin(), kernelBlockValue.end(), blockId) != kernelBlockValue.end())
+            if (kernelBlockValue.find(blockId) != kernelBlockValue.end())
             {
                 for (BasicBlock::iterator BI = block->begin(), BE = block->end(); BI != BE; ++BI)
                 {
@@ -86,20 +87,7 @@ namespace DashTracer::Passes
         DumpStoreValue = cast<Function>(M.getOrInsertFunction("DumpStoreValue", Type::getVoidTy(M.getContext()), Type::getIntNPtrTy(M.getContext(), 8), Type::getInt8Ty(M.getContext())).getCallee());
         LoadDump = cast<Function>(M.getOrInsertFunction("LoadDump", Type::getVoidTy(M.getContext()), Type::getIntNPtrTy(M.getContext(), 8)).getCallee());
         StoreDump = cast<Function>(M.getOrInsertFunction("StoreDump", Type::getVoidTy(M.getContext()), Type::getIntNPtrTy(M.getContext(), 8)).getCallee());
-        kernelBlockValue.clear();
-        nlohmann::json j;
-        std::ifstream inputStream(KernelFilename);
-        inputStream >> j;
-        inputStream.close();
-        for (auto &[key, value] : j["Kernels"].items())
-        {
-            string index = key;
-            if (stoi(index) == KernelIndex)
-            {
-                nlohmann::json kernel = value["Blocks"];
-                kernelBlockValue = kernel.get<vector<uint64_t>>();
-            }
-        }
+        kernelBlockValue = ReadKernelBlocks(KernelFilename, {KernelIndex});
 
         return false;
     }
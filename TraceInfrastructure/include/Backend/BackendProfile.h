@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+/// <summary>
+/// Writes the execution count of every executed block to the profile file, one "block,count" line each.
+/// The file is named by PROFILE_NAME and defaults to profile.csv.
+/// </summary>
+/// <param name="counts">The block counters, indexed by block ID.</param>
+/// <param name="size">The number of counters.</param>
+void DumpBlockProfile(uint64_t *counts, uint64_t size);
+
+/// <summary>
+/// Writes the edge counters of a binary instrumented by the EdgeProfile pass to the profile file.
+/// The file is binary, see EDGE_PROFILE_MAGIC, and is named by PROFILE_NAME, defaulting to profile.bin.
+/// </summary>
+/// <param name="counts">The edge counters.</param>
+/// <param name="size">The number of counters.</param>
+void DumpEdgeProfile(uint64_t *counts, uint64_t size);
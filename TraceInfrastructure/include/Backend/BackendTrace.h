@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /// <summary>
@@ -8,6 +9,19 @@
 /// <param name="input">The string to be written</param>
 void WriteStream(char *input);
 
+/// <summary>
+/// Writes size bytes of input to the trace buffer, flushing as many times as necessary.
+/// </summary>
+/// <param name="input">The bytes to be written</param>
+/// <param name="size">The number of bytes to be written</param>
+void WriteStreamBytes(const uint8_t *input, size_t size);
+
+/// <summary>
+/// Writes a free form text line to the trace, as a text record when the binary encoding is used.
+/// </summary>
+/// <param name="line">The line to be written</param>
+void WriteText(char *line);
+
 /// <summary>
 /// Compresses the trace buffer and writes it to the destination file.
 /// </summary>
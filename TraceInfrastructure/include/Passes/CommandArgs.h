@@ -20,4 +20,37 @@ extern cl::opt<bool> DumpStores;
 
 extern cl::opt<std::string> LibraryName;
 
+/// <summary>
+/// Count block executions in the binary instead of tracing every event.
+/// </summary>
+extern cl::opt<bool> CountBlocks;
+/// <summary>
+/// Increment the block counters atomically, for multithreaded applications.
+/// </summary>
+extern cl::opt<bool> AtomicCounts;
+/// <summary>
+/// The file the EdgeProfile pass writes its edge map to.
+/// </summary>
+extern cl::opt<std::string> EdgeMapFile;
+/// <summary>
+/// The kernel indices upon which to work, every kernel of the kernel file if empty.
+/// </summary>
+extern cl::list<int> KernelIndices;
+/// <summary>
+/// Function globs to instrument exclusively.
+/// </summary>
+extern cl::list<std::string> TraceFunctions;
+/// <summary>
+/// Function globs to leave uninstrumented.
+/// </summary>
+extern cl::list<std::string> SkipFunctions;
+/// <summary>
+/// Block ID ranges to instrument exclusively.
+/// </summary>
+extern cl::list<std::string> TraceBlocks;
+/// <summary>
+/// Block ID ranges to leave uninstrumented.
+/// </summary>
+extern cl::list<std::string> SkipBlocks;
+
 #endif
\ No newline at end of file
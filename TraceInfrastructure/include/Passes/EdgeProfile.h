@@ -0,0 +1,28 @@
+#pragma once
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Pass.h>
+
+using namespace llvm;
+
+namespace DashTracer
+{
+    namespace Passes
+    {
+        /// <summary>
+        /// Counts the edges off a spanning tree of every function's flow graph. The edge map written next to the binary lets edgeResolver recover
+        /// the counts of every edge and block from the profile.
+        /// </summary>
+        struct EdgeProfile : public ModulePass
+        {
+            static char ID;
+            EdgeProfile() : ModulePass(ID) {}
+            bool runOnModule(Module &M) override;
+            void getAnalysisUsage(AnalysisUsage &AU) const override;
+
+        private:
+            GlobalVariable *edgeCounters = nullptr;
+            void CountEdge(BasicBlock *source, BasicBlock *target, uint64_t counter);
+        };
+    } // namespace Passes
+} // namespace DashTracer
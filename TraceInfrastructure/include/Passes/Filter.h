@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdint>
+#include <llvm/IR/Function.h>
+#include <llvm/Support/GlobPattern.h>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+namespace DashTracer
+{
+    namespace Passes
+    {
+        /// <summary>
+        /// Reads the blocks of the given kernels from a kernel json.
+        /// Both the cartographer layout ("Kernels" holding "Blocks") and a plain map of kernel indices to blocks are accepted.
+        /// </summary>
+        /// <param name="kernelFile">The kernel json.</param>
+        /// <param name="indices">The kernels to read, every kernel if empty.</param>
+        std::unordered_set<int64_t> ReadKernelBlocks(const std::string &kernelFile, const std::vector<int> &indices);
+
+        /// <summary>
+        /// Selects the functions and blocks to instrument from the allow and deny lists of the command line.
+        /// Everything is instrumented unless an allow list is given, deny lists always win.
+        /// </summary>
+        class InstrumentationFilter
+        {
+        public:
+            /// <summary>
+            /// Reads the function globs, block ranges and kernels of the command line.
+            /// </summary>
+            void Load();
+            bool Instrument(const Function &F) const;
+            bool Instrument(int64_t block) const;
+
+        private:
+            std::vector<GlobPattern> allowFunctions;
+            std::vector<GlobPattern> denyFunctions;
+            std::vector<std::pair<int64_t, int64_t>> allowRanges;
+            std::vector<std::pair<int64_t, int64_t>> denyRanges;
+            std::unordered_set<int64_t> kernelBlocks;
+            bool kernelFilter = false;
+        };
+    } // namespace Passes
+} // namespace DashTracer
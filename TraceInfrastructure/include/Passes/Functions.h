@@ -18,6 +18,8 @@ namespace DashTracer
         extern Function *DumpLoadValue;
         extern Function *fullFunc;
         extern Function *fullAddrFunc;
+        extern Function *DumpBlockProfile;
+        extern Function *DumpEdgeProfile;
     } // namespace Passes
 } // namespace DashTracer
 
@@ -1,4 +1,6 @@
 #pragma once
+#include "Passes/Filter.h"
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/Pass.h>
 
 using namespace llvm;
@@ -16,6 +18,15 @@ namespace DashTracer
             bool runOnFunction(Function &F) override;
             void getAnalysisUsage(AnalysisUsage &AU) const override;
             bool doInitialization(Module &M) override;
+
+        private:
+            /// <summary>
+            /// The block counters of the count mode, one per block ID.
+            /// </summary>
+            GlobalVariable *blockCounters = nullptr;
+            uint64_t blockTotal = 0;
+            void CountBlock(BasicBlock *BB, int64_t id);
+            InstrumentationFilter filter;
         };
     } // namespace Passes
 } // namespace DashTracer
@@ -67,45 +67,51 @@ string GenerateGraph(map<int, string> instanceMap, const map<int, set<int>> &con
     return result;
 }
 
-void Process(string &key, string &value)
+void Process(const TraceEvent &event)
 {
-    if (key == "BBEnter")
+    switch (event.op)
     {
-        int block = stoi(value, nullptr, 0);
-        if (currentKernel == "-1" || kernelMap[currentKernel].find(block) == kernelMap[currentKernel].end())
+        case TraceOp::BBEnter:
         {
-            //we aren't in the same kernel as last time
-            string innerKernel = "-1";
-            for (auto k : kernelMap)
+            auto block = (int)event.number;
+            if (currentKernel == "-1" || kernelMap[currentKernel].find(block) == kernelMap[currentKernel].end())
             {
-                if (k.second.find(block) != k.second.end())
+                //we aren't in the same kernel as last time
+                string innerKernel = "-1";
+                for (auto k : kernelMap)
                 {
-                    //we have a matching kernel
-                    innerKernel = k.first;
-                    break;
+                    if (k.second.find(block) != k.second.end())
+                    {
+                        //we have a matching kernel
+                        innerKernel = k.first;
+                        break;
+                    }
+                }
+                currentKernel = innerKernel;
+                if (innerKernel != "-1")
+                {
+                    currentUid = UID;
+                    kernelIdMap[UID++] = currentKernel;
                 }
             }
-            currentKernel = innerKernel;
-            if (innerKernel != "-1")
+            break;
+        }
+        case TraceOp::LoadAddress:
+        {
+            int prodUid = writeMap[event.number];
+            if (prodUid != -1 && prodUid != currentUid)
             {
-                currentUid = UID;
-                kernelIdMap[UID++] = currentKernel;
+                consumerMap[currentUid].insert(prodUid);
             }
+            break;
         }
-    }
-    else if (key == "LoadAddress")
-    {
-        uint64_t address = stoul(value, nullptr, 0);
-        int prodUid = writeMap[address];
-        if (prodUid != -1 && prodUid != currentUid)
+        case TraceOp::StoreAddress:
         {
-            consumerMap[currentUid].insert(prodUid);
+            writeMap[event.number] = currentUid;
+            break;
         }
-    }
-    else if (key == "StoreAddress")
-    {
-        uint64_t address = stoul(value, nullptr, 0);
-        writeMap[address] = currentUid;
+        default:
+            break;
     }
 }
 
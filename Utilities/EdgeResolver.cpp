@@ -0,0 +1,85 @@
+#include "AtlasUtil/EdgeProfile.h"
+#include <fstream>
+#include <llvm/Support/CommandLine.h>
+#include <map>
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+cl::opt<std::string> InputFilename("i", cl::desc("Specify input edge profile"), cl::value_desc("profile filename"), cl::Required);
+cl::opt<std::string> MapFilename("m", cl::desc("Specify the edge map written by the EdgeProfile pass"), cl::value_desc("edge map filename"), cl::init("edges.json"));
+cl::opt<std::string> OutputFilename("o", cl::desc("Specify output json"), cl::value_desc("output filename"), cl::Required);
+
+int main(int argc, char **argv)
+{
+    cl::ParseCommandLineOptions(argc, argv);
+
+    nlohmann::json edgeMap;
+    vector<uint64_t> counters;
+    try
+    {
+        ifstream mapStream(MapFilename);
+        if (!mapStream)
+        {
+            throw AtlasException("Failed to open edge map: " + MapFilename);
+        }
+        mapStream >> edgeMap;
+        counters = ReadEdgeProfile(InputFilename);
+        if (edgeMap["Counters"].get<uint64_t>() != counters.size())
+        {
+            throw AtlasException("Edge profile does not match the edge map");
+        }
+    }
+    catch (AtlasException &e)
+    {
+        spdlog::critical(e.what());
+        return EXIT_FAILURE;
+    }
+
+    map<string, uint64_t> blockCounts;
+    map<string, map<string, uint64_t>> edgeCounts;
+    map<string, uint64_t> callCounts;
+    for (auto &[function, functionEdges] : edgeMap["Functions"].items())
+    {
+        vector<ProfileEdge> edges;
+        for (auto &edge : functionEdges)
+        {
+            edges.push_back({edge[0].get<int64_t>(), edge[1].get<int64_t>(), edge[2].get<int64_t>()});
+        }
+        if (!SolveEdgeCounts(edges, counters))
+        {
+            spdlog::warn("Failed to recover every edge count of " + function);
+        }
+        for (const auto &edge : edges)
+        {
+            if (edge.source == EDGE_PROFILE_EXIT)
+            {
+                callCounts[function] = edge.count;
+            }
+            else if (edge.target != EDGE_PROFILE_EXIT && edge.count != 0)
+            {
+                edgeCounts[to_string(edge.source)][to_string(edge.target)] = edge.count;
+            }
+        }
+        for (const auto &[block, count] : EdgeBlockCounts(edges))
+        {
+            if (count != 0)
+            {
+                blockCounts[to_string(block)] = count;
+            }
+        }
+    }
+
+    nlohmann::json outputJson;
+    outputJson["BlockCounts"] = blockCounts;
+    outputJson["EdgeCounts"] = edgeCounts;
+    outputJson["CallCounts"] = callCounts;
+    ofstream oStream(OutputFilename);
+    oStream << outputJson;
+    oStream.close();
+    return EXIT_SUCCESS;
+}
@@ -53,50 +53,62 @@ bool structEq(myns::labelGroup &gp1, myns::labelGroup &gp2) {
     return true;
 }
 
-void Process(string &key, string &value)
+void Process(const TraceEvent &event)
 {
-    if (key == "BBEnter") {
-        blockStack.push_back(stol(value, nullptr, 0));
-    }
-    if (key == "BBExit")
+    switch (event.op)
     {
-        int64_t block = stol(value, nullptr, 0);
-        labels[block].insert(currentLabels.begin(), currentLabels.end());
-        blockStack.pop_back();
-
-        if (!currentLabels.empty()) {
-            labelsAndBBVecs.back().blocks.insert(block);
+        case TraceOp::BBEnter:
+        {
+            blockStack.push_back((int64_t)event.number);
+            break;
         }
-    }
-    else if (key == "KernelEnter")
-    {
-        currentLabels.insert(value);
-        if (kernelInstanceCounter.find(value) == kernelInstanceCounter.end()) {
-            kernelInstanceCounter[value] = 1;
-        } else {
-            kernelInstanceCounter[value]++;
+        case TraceOp::BBExit:
+        {
+            auto block = (int64_t)event.number;
+            labels[block].insert(currentLabels.begin(), currentLabels.end());
+            blockStack.pop_back();
+
+            if (!currentLabels.empty()) {
+                labelsAndBBVecs.back().blocks.insert(block);
+            }
+            break;
         }
+        case TraceOp::KernelEnter:
+        {
+            string label(event.data);
+            currentLabels.insert(label);
+            if (kernelInstanceCounter.find(label) == kernelInstanceCounter.end()) {
+                kernelInstanceCounter[label] = 1;
+            } else {
+                kernelInstanceCounter[label]++;
+            }
 
-        labelsAndBBVecs.emplace_back();
-        labelsAndBBVecs.back().kernelLabel = value;
-        labelsAndBBVecs.back().blocks = {};
-        labelsAndBBVecs.back().instanceNum = kernelInstanceCounter[value];
-        labelsAndBBVecs.back().globalUID = GLOBAL_UID++;
-    }
-    else if (key == "KernelExit")
-    {
-        // Note: we need to capture the current basic block as part of the kernel potentially as well.
-        // The top element of the basic block stack should correspond to the block that this kernel exit resides in (?)
-        labelsAndBBVecs.back().blocks.insert(blockStack.back());
-        currentLabels.erase(value);
-        for (auto idx = 0; idx < labelsAndBBVecs.size()-1; idx++) {
-            if (structEq(labelsAndBBVecs.at(idx), labelsAndBBVecs.back())) {
-                //cout << "I found a duplicate struct and I'm dropping it" << endl;
-                labelsAndBBVecs.pop_back();
-                kernelInstanceCounter[value]--;
-                GLOBAL_UID--;
+            labelsAndBBVecs.emplace_back();
+            labelsAndBBVecs.back().kernelLabel = label;
+            labelsAndBBVecs.back().blocks = {};
+            labelsAndBBVecs.back().instanceNum = kernelInstanceCounter[label];
+            labelsAndBBVecs.back().globalUID = GLOBAL_UID++;
+            break;
+        }
+        case TraceOp::KernelExit:
+        {
+            string label(event.data);
+            // Note: we need to capture the current basic block as part of the kernel potentially as well.
+            // The top element of the basic block stack should correspond to the block that this kernel exit resides in (?)
+            labelsAndBBVecs.back().blocks.insert(blockStack.back());
+            currentLabels.erase(label);
+            for (auto idx = 0; idx < labelsAndBBVecs.size()-1; idx++) {
+                if (structEq(labelsAndBBVecs.at(idx), labelsAndBBVecs.back())) {
+                    //cout << "I found a duplicate struct and I'm dropping it" << endl;
+                    labelsAndBBVecs.pop_back();
+                    kernelInstanceCounter[label]--;
+                    GLOBAL_UID--;
+                }
             }
+            break;
         }
+        default:
+            break;
     }
 }
 
@@ -0,0 +1,149 @@
+#include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/TraceWriter.h"
+#include "AtlasUtil/Traces.h"
+#include <chrono>
+#include <cstdio>
+#include <llvm/Support/CommandLine.h>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+cl::opt<string> InputFilename("i", cl::desc("Specify input trace"), cl::value_desc("trace filename"), cl::Required);
+cl::opt<string> OutputFilename("o", cl::desc("Specify output trace"), cl::value_desc("trace filename"), cl::Required);
+cl::opt<string> CodecName("c", cl::desc("Codec of the output trace: zlib, zstd, lz4 or none"), cl::value_desc("codec"), cl::init("zlib"));
+cl::opt<int> CompressionLevel("l", cl::desc("Compression level of the output trace"), cl::value_desc("level"), cl::init(9));
+cl::opt<unsigned int> FrameSize("f", cl::desc("Size of the output frames in MB"), cl::value_desc("frame size"), cl::init(8));
+cl::opt<bool> Verify("verify", cl::desc("Read the output back and compare it to the input event by event"));
+
+static uint64_t FileSize(const string &file)
+{
+    struct stat fileStat;
+    if (stat(file.c_str(), &fileStat) != 0)
+    {
+        throw AtlasException("Failed to open trace file: " + file);
+    }
+    return (uint64_t)fileStat.st_size;
+}
+
+/// <summary>
+/// Reads both traces in lockstep and throws at the first event that differs. Version headers are not compared.
+/// </summary>
+static uint64_t VerifyTrace(const string &original, const string &encoded)
+{
+    TraceReader originalReader(original);
+    TraceReader encodedReader(encoded);
+    TraceEvent a;
+    TraceEvent b;
+    for (uint64_t index = 0;; index++)
+    {
+        bool hasA;
+        bool hasB;
+        do
+        {
+            hasA = originalReader.Next(a);
+        } while (hasA && a.op == TraceOp::TraceVersion);
+        do
+        {
+            hasB = encodedReader.Next(b);
+        } while (hasB && b.op == TraceOp::TraceVersion);
+        if (!hasA || !hasB)
+        {
+            if (hasA != hasB)
+            {
+                throw AtlasException(encoded + " has " + (hasA ? "fewer" : "more") + " events than " + original + " after event " + to_string(index));
+            }
+            return index;
+        }
+        // other records must come back as the exact line they were read from
+        if (a.op != b.op || a.number != b.number || a.data != b.data || (a.op == TraceOp::Other && TraceOtherLine(a) != TraceOtherLine(b)))
+        {
+            throw AtlasException("Event " + to_string(index) + " of " + encoded + " is " + string(b.key) + ":" + to_string(b.number) + " instead of " + string(a.key) + ":" + to_string(a.number));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    cl::ParseCommandLineOptions(argc, argv);
+
+    int codec;
+    if (CodecName == "zlib")
+    {
+        codec = TraceCodecZlib;
+    }
+    else if (CodecName == "zstd")
+    {
+        codec = TraceCodecZstd;
+    }
+    else if (CodecName == "lz4")
+    {
+        codec = TraceCodecLz4;
+    }
+    else if (CodecName == "none")
+    {
+        codec = TraceCodecNone;
+    }
+    else
+    {
+        spdlog::critical("Unknown codec: " + CodecName);
+        return EXIT_FAILURE;
+    }
+    // a frame size of 0 puts the whole trace into one frame
+    uint64_t frameBytes = FrameSize == 0 ? UINT64_MAX : (uint64_t)FrameSize * 1024 * 1024;
+
+    try
+    {
+        // the files of a multithreaded trace are converted one by one, so their sequence records are kept
+        auto inputs = GetThreadTraces(InputFilename);
+        uint16_t run = TraceRun(InputFilename);
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            string output = i == 0 ? string(OutputFilename) : OutputFilename + "." + to_string(i);
+            auto start = chrono::steady_clock::now();
+            uint64_t events = 0;
+            uint64_t frames;
+            uint64_t written;
+            {
+                TraceReader reader(inputs[i]);
+                TraceWriter writer(output, codec, CompressionLevel, frameBytes, run);
+                TraceEvent event;
+                while (reader.Next(event))
+                {
+                    writer.Write(event);
+                    events++;
+                }
+                writer.Close();
+                frames = writer.frames.size();
+                written = writer.written;
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            uint64_t read = FileSize(inputs[i]);
+            spdlog::info("Encoded " + inputs[i] + " into " + output + ": " + to_string(events) + " events in " + to_string(frames) + " frames, " + to_string(read) + " -> " + to_string(written) + " bytes (ratio " + to_string((double)read / (double)written) + ") in " + to_string(seconds) + "s (" + to_string((double)read / 1048576.0 / seconds) + " MB/s)");
+            if (Verify)
+            {
+                start = chrono::steady_clock::now();
+                uint64_t checked = VerifyTrace(inputs[i], output);
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                spdlog::info("Verified " + to_string(checked) + " events of " + output + " in " + to_string(seconds) + "s");
+            }
+        }
+        // thread files of an earlier output with more threads would be merged into this one
+        for (size_t i = inputs.size();; i++)
+        {
+            if (remove((OutputFilename + "." + to_string(i)).c_str()) != 0)
+            {
+                break;
+            }
+        }
+    }
+    catch (AtlasException &e)
+    {
+        spdlog::critical(e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
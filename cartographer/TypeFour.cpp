@@ -1,20 +1,18 @@
 #include "TypeFour.h"
-#include "AtlasUtil/Annotate.h"
 #include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/Parallel.h"
 #include "AtlasUtil/Print.h"
 #include "cartographer.h"
-#include "tik/Util.h"
 #include <indicators/progress_bar.hpp>
-#include <queue>
+#include <mutex>
 #include <spdlog/spdlog.h>
+#include <vector>
 
 using namespace std;
 using namespace llvm;
 
 namespace TypeFour
 {
-    //this was taken from tik. It should probably be moved to libtik once it is made
-
     set<set<int64_t>> Process(const set<set<int64_t>> &type3Kernels)
     {
         indicators::ProgressBar bar;
@@ -29,39 +27,27 @@ namespace TypeFour
         uint64_t total = type3Kernels.size();
         int status = 0;
 
-        set<set<int64_t>> result;
-        for (const auto &kernel : type3Kernels)
-        {
+        //the kernels are independent and the block graph is only read, so they are split concurrently
+        vector<set<int64_t>> kernels(type3Kernels.begin(), type3Kernels.end());
+        vector<vector<set<int64_t>>> parts(kernels.size());
+        mutex progress;
+        ParallelFor(kernels.size(), [&](size_t i) {
+            const auto &kernel = kernels[i];
             set<int64_t> blocks;
             for (auto block : kernel)
             {
                 //we need to see if this block can ever reach itself
-                BasicBlock *base = blockMap[block];
-                if (TraceAtlas::tik::IsSelfReachable(base, kernel))
+                if (blockGraph.IsSelfReachable(block, kernel))
                 {
                     blocks.insert(block);
                 }
             }
             //blocks is now a set, but it may be disjoint, so we need to check that now
-
-            set<BasicBlock *> blockSet;
-            for (auto block : blocks)
-            {
-                blockSet.insert(blockMap[block]);
-            }
-
-            set<BasicBlock *> entrances = TraceAtlas::tik::GetEntrances(blockSet);
-
-            for (auto ent : entrances)
+            for (auto ent : blockGraph.GetEntrances(blocks))
             {
-                auto a = TraceAtlas::tik::GetReachable(ent, blocks);
-                set<int64_t> b;
-                for (auto as : a)
-                {
-                    b.insert(GetBlockID(as));
-                }
-                result.insert(b);
+                parts[i].push_back(blockGraph.GetReachable(ent, blocks));
             }
+            lock_guard<mutex> guard(progress);
             status++;
             if (!noBar)
             {
@@ -69,6 +55,11 @@ namespace TypeFour
                 bar.set_option(indicators::option::PostfixText{"Kernel " + to_string(status) + "/" + to_string(total)});
                 bar.set_progress(percent);
             }
+        });
+        set<set<int64_t>> result;
+        for (const auto &part : parts)
+        {
+            result.insert(part.begin(), part.end());
         }
 
         if (!noBar && !bar.is_completed())
@@ -1,35 +1,384 @@
 #include "cartographer.h"
+#include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/Traces.h"
 #include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
 #include <map>
+#include <mutex>
+#include <nlohmann/json.hpp>
 #include <queue>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
 namespace TypeOne
 {
-    std::map<int64_t, std::map<int64_t, uint64_t>> blockMap;
-    std::map<int64_t, uint64_t> blockCount;
-    std::deque<int64_t> priorBlocks;
-    uint32_t radius = 5;
-    void Process(std::string &key, std::string &value)
+    typedef std::vector<std::vector<std::pair<int64_t, uint64_t>>> BlockMap;
+    /// <summary>
+    /// Block IDs are dense, so the statistics are indexed by them directly.
+    /// Every row of the block map lists the blocks seen around the block with their counts, sorted by block.
+    /// </summary>
+    std::vector<uint64_t> blockCount;
+    BlockMap blockMap;
+    constexpr uint32_t radius = 5;
+    constexpr uint32_t windowSize = 2 * radius + 1;
+    /// <summary>
+    /// The number of block events in a shard of the trace.
+    /// </summary>
+    constexpr size_t shardSize = 1 << 20;
+    uint64_t sampledBlocks = 0;
+    uint64_t skippedBlocks = 0;
+
+    /// <summary>
+    /// The last windowSize blocks, a ring starting at start.
+    /// </summary>
+    struct Window
+    {
+        int64_t blocks[windowSize];
+        uint32_t start = 0;
+        uint32_t size = 0;
+
+        void Push(int64_t block)
+        {
+            if (size == windowSize)
+            {
+                blocks[start] = block;
+                start = (start + 1) % windowSize;
+            }
+            else
+            {
+                blocks[(start + size) % windowSize] = block;
+                size++;
+            }
+        }
+        int64_t operator[](uint32_t i) const
+        {
+            return blocks[(start + i) % windowSize];
+        }
+    };
+
+    /// <summary>
+    /// A piece of the trace the co-occurrence counts are accumulated on independently.
+    /// Blocks holds the blocks that were entered, -1 for a gap of a sampled trace. Prior is the window before the first of them,
+    /// so the blocks at the start of the shard are related to those at the end of the previous one.
+    /// </summary>
+    struct Shard
+    {
+        Window prior;
+        std::vector<int64_t> blocks;
+    };
+
+    /// <summary>
+    /// The window and shard of the events passed to Process so far.
+    /// </summary>
+    Window window;
+    Shard shard;
+    /// <summary>
+    /// The pool that accumulates the shards, every worker into its own partial block map.
+    /// </summary>
+    std::vector<std::thread> workers;
+    std::vector<BlockMap> partials;
+    std::deque<Shard> shards;
+    std::mutex lock;
+    std::condition_variable change;
+    bool done = false;
+    std::exception_ptr failure;
+
+    void Reserve(int64_t block)
+    {
+        if ((uint64_t)block >= blockCount.size())
+        {
+            size_t size = std::max((size_t)block + 1, blockCount.size() * 2);
+            blockCount.resize(size);
+            blockMap.resize(size);
+        }
+    }
+
+    void Increment(std::vector<std::pair<int64_t, uint64_t>> &row, int64_t block, uint64_t count)
+    {
+        auto entry = std::lower_bound(row.begin(), row.end(), block, [](const std::pair<int64_t, uint64_t> &a, int64_t b) { return a.first < b; });
+        if (entry != row.end() && entry->first == block)
+        {
+            entry->second += count;
+        }
+        else
+        {
+            row.insert(entry, {block, count});
+        }
+    }
+
+    uint64_t BlockCount(int64_t block)
+    {
+        return block >= 0 && (uint64_t)block < blockCount.size() ? blockCount[(size_t)block] : 0;
+    }
+
+    void SetBlockCounts(const std::map<int64_t, uint64_t> &counts)
+    {
+        std::fill(blockCount.begin(), blockCount.end(), 0);
+        for (const auto &[block, count] : counts)
+        {
+            Reserve(block);
+            blockCount[(size_t)block] = count;
+        }
+    }
+
+    void Accumulate(const Shard &current, BlockMap &partial)
+    {
+        Window prior = current.prior;
+        for (auto block : current.blocks)
+        {
+            if (block < 0)
+            {
+                prior.size = 0;
+                continue;
+            }
+            prior.Push(block);
+            if (prior.size > radius)
+            {
+                if ((size_t)block >= partial.size())
+                {
+                    partial.resize(std::max((size_t)block + 1, partial.size() * 2));
+                }
+                auto &row = partial[(size_t)block];
+                for (uint32_t i = 0; i < prior.size; i++)
+                {
+                    Increment(row, prior[i], 1);
+                }
+            }
+        }
+    }
+
+    void Work(BlockMap &partial)
+    {
+        bool failed = false;
+        while (true)
+        {
+            Shard current;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                change.wait(guard, []() { return !shards.empty() || done; });
+                if (shards.empty())
+                {
+                    break;
+                }
+                current = std::move(shards.front());
+                shards.pop_front();
+            }
+            change.notify_all();
+            // a failed worker keeps taking shards so the trace is not blocked
+            if (!failed)
+            {
+                try
+                {
+                    Accumulate(current, partial);
+                }
+                catch (...)
+                {
+                    failed = true;
+                    std::lock_guard<std::mutex> guard(lock);
+                    if (!failure)
+                    {
+                        failure = std::current_exception();
+                    }
+                }
+            }
+        }
+    }
+
+    /// <summary>
+    /// Hands the current shard to the pool and starts the next one, waiting while the pool is behind.
+    /// </summary>
+    void Dispatch()
+    {
+        if (workers.empty())
+        {
+            unsigned int threads = std::max(std::thread::hardware_concurrency(), 1U);
+            partials.resize(threads);
+            for (unsigned int i = 0; i < threads; i++)
+            {
+                workers.emplace_back(Work, std::ref(partials[i]));
+            }
+        }
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            change.wait(guard, []() { return shards.size() < 2 * workers.size(); });
+            shards.push_back(std::move(shard));
+        }
+        change.notify_all();
+        shard.prior = window;
+        shard.blocks.clear();
+        shard.blocks.reserve(shardSize);
+    }
+
+    /// <summary>
+    /// Adds the rows of a partial block map to those of the block map.
+    /// </summary>
+    void MergeRow(std::vector<std::pair<int64_t, uint64_t>> &row, std::vector<std::pair<int64_t, uint64_t>> &partial)
     {
-        if (key == "BBEnter")
+        if (row.empty())
+        {
+            row = std::move(partial);
+            return;
+        }
+        std::vector<std::pair<int64_t, uint64_t>> merged;
+        merged.reserve(row.size() + partial.size());
+        auto a = row.begin();
+        auto b = partial.begin();
+        while (a != row.end() || b != partial.end())
         {
-            long int block = stoi(value, nullptr, 0);
-            blockCount[block] += 1;
-            priorBlocks.push_back(block);
+            if (b == partial.end() || (a != row.end() && a->first < b->first))
+            {
+                merged.push_back(*a++);
+            }
+            else if (a == row.end() || b->first < a->first)
+            {
+                merged.push_back(*b++);
+            }
+            else
+            {
+                merged.emplace_back(a->first, a->second + b->second);
+                a++;
+                b++;
+            }
+        }
+        row = std::move(merged);
+    }
 
-            if (priorBlocks.size() > (2 * radius + 1))
+    void Process(const TraceEvent &event)
+    {
+        switch (event.op)
+        {
+            case TraceOp::BBEnter:
             {
-                priorBlocks.pop_front();
+                auto block = (int64_t)event.number;
+                Reserve(block);
+                blockCount[(size_t)block] += 1;
+                sampledBlocks++;
+                window.Push(block);
+                shard.blocks.push_back(block);
+                break;
             }
-            if (priorBlocks.size() > radius)
+            case TraceOp::Skip:
             {
-                for (auto i : priorBlocks)
+                skippedBlocks += event.number;
+                //the window must not relate the blocks on either side of the gap
+                window.size = 0;
+                shard.blocks.push_back(-1);
+                break;
+            }
+            default:
+                return;
+        }
+        if (shard.blocks.size() >= shardSize)
+        {
+            Dispatch();
+        }
+    }
+
+    void Finish()
+    {
+        if (!shard.blocks.empty())
+        {
+            Dispatch();
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+        }
+        change.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        workers.clear();
+        if (failure)
+        {
+            std::rethrow_exception(failure);
+        }
+
+        // every thread reduces its own share of the rows
+        size_t size = 0;
+        for (const auto &partial : partials)
+        {
+            size = std::max(size, partial.size());
+        }
+        // with every partial empty there is no row to make room for
+        if (size != 0)
+        {
+            Reserve((int64_t)size - 1);
+        }
+        std::vector<std::thread> reducers;
+        for (size_t i = 0; i < partials.size(); i++)
+        {
+            reducers.emplace_back([i, size]() {
+                for (size_t block = i; block < size; block += partials.size())
+                {
+                    for (auto &partial : partials)
+                    {
+                        if (block < partial.size())
+                        {
+                            MergeRow(blockMap[block], partial[block]);
+                        }
+                    }
+                }
+            });
+        }
+        for (auto &reducer : reducers)
+        {
+            reducer.join();
+        }
+        partials.clear();
+    }
+
+    double ScaleSampledCounts()
+    {
+        if (skippedBlocks == 0 || sampledBlocks == 0)
+        {
+            return 1.0;
+        }
+        double scale = (double)(sampledBlocks + skippedBlocks) / (double)sampledBlocks;
+        for (auto &count : blockCount)
+        {
+            count = (uint64_t)llround((double)count * scale);
+        }
+        return scale;
+    }
+
+    void ProcessEdgeProfile(const std::string &profileFile)
+    {
+        std::ifstream profileStream(profileFile);
+        if (!profileStream)
+        {
+            throw AtlasException("Failed to open edge profile: " + profileFile);
+        }
+        nlohmann::json profile;
+        profileStream >> profile;
+        //without the order of the trace a block is only grouped with itself and its direct neighbors
+        for (auto &[block, count] : profile["BlockCounts"].items())
+        {
+            int64_t id = stoll(block);
+            Reserve(id);
+            blockCount[(size_t)id] += count.get<uint64_t>();
+            Increment(blockMap[(size_t)id], id, count.get<uint64_t>());
+        }
+        for (auto &[source, targets] : profile["EdgeCounts"].items())
+        {
+            for (auto &[target, count] : targets.items())
+            {
+                int64_t sourceId = stoll(source);
+                int64_t targetId = stoll(target);
+                if (sourceId != targetId)
                 {
-                    blockMap[block][i]++;
+                    Reserve(std::max(sourceId, targetId));
+                    Increment(blockMap[(size_t)sourceId], targetId, count.get<uint64_t>());
+                    Increment(blockMap[(size_t)targetId], sourceId, count.get<uint64_t>());
                 }
             }
         }
@@ -37,18 +386,19 @@ namespace TypeOne
 
     std::set<std::set<int64_t>> Get()
     {
-        std::map<int64_t, std::vector<std::pair<int64_t, float>>> fBlockMap;
-        for (auto &key : blockMap)
+        std::vector<std::vector<std::pair<int64_t, float>>> fBlockMap(blockMap.size());
+        for (size_t block = 0; block < blockMap.size(); block++)
         {
             uint64_t total = 0;
-            for (auto &sub : key.second)
+            for (auto &sub : blockMap[block])
             {
                 total += sub.second;
             }
-            for (auto &sub : key.second)
+            fBlockMap[block].reserve(blockMap[block].size());
+            for (auto &sub : blockMap[block])
             {
                 float val = (float)sub.second / (float)total;
-                fBlockMap[key.first].push_back(std::pair<int64_t, float>(sub.first, val));
+                fBlockMap[block].push_back(std::pair<int64_t, float>(sub.first, val));
             }
         }
 
@@ -56,10 +406,12 @@ namespace TypeOne
         std::vector<std::set<int64_t>> kernels;
 
         std::vector<std::pair<int64_t, int64_t>> blockPairs;
-        blockPairs.reserve(blockCount.size());
-        for (auto &iter : blockCount)
+        for (size_t block = 0; block < blockCount.size(); block++)
         {
-            blockPairs.emplace_back(iter);
+            if (blockCount[block] != 0)
+            {
+                blockPairs.emplace_back(block, blockCount[block]);
+            }
         }
 
         std::sort(blockPairs.begin(), blockPairs.end(), [=](std::pair<int64_t, int64_t> &a, std::pair<int64_t, int64_t> &b) {
@@ -89,7 +441,7 @@ namespace TypeOne
                 if (covered.find(it.first) == covered.end())
                 {
                     float sum = 0.0;
-                    vector<pair<int64_t, float>> values = fBlockMap[it.first];
+                    vector<pair<int64_t, float>> values = fBlockMap[(size_t)it.first];
                     std::sort(values.begin(), values.end(), [=](std::pair<int64_t, float> &a, std::pair<int64_t, float> &b) {
                         bool result;
                         if (a.second > b.second)
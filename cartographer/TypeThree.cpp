@@ -1,14 +1,97 @@
 #include "TypeThree.h"
-#include "AtlasUtil/Annotate.h"
+#include "AtlasUtil/Parallel.h"
 #include "cartographer.h"
+#include <algorithm>
 #include <indicators/progress_bar.hpp>
-#include <llvm/IR/CFG.h>
-#include <llvm/IR/Instructions.h>
+#include <mutex>
+#include <vector>
 
 using namespace std;
 using namespace llvm;
 namespace TypeThree
 {
+    /// <summary>
+    /// Removes the blocks of the kernel that have no predecessor or no successor inside it, until every block has both.
+    /// A function entry is entered from the blocks that call the function and a returning block continues in them.
+    /// Every block counts its predecessors and successors in the kernel, so removing a block only revisits the blocks it was counted for.
+    /// </summary>
+    set<int64_t> Prune(const set<int64_t> &kernel)
+    {
+        vector<int64_t> blocks(kernel.begin(), kernel.end());
+        size_t n = blocks.size();
+        vector<uint32_t> preCount(n, 0);
+        vector<uint32_t> sucCount(n, 0);
+        vector<vector<size_t>> preDependents(n);
+        vector<vector<size_t>> sucDependents(n);
+        auto count = [&](size_t i, int64_t source, vector<uint32_t> &counts, vector<vector<size_t>> &dependents) {
+            auto entry = lower_bound(blocks.begin(), blocks.end(), source);
+            if (entry != blocks.end() && *entry == source)
+            {
+                counts[i]++;
+                dependents[(size_t)(entry - blocks.begin())].push_back(i);
+            }
+        };
+        for (size_t i = 0; i < n; i++)
+        {
+            int64_t base = blocks[i];
+            //check if there is a valid predecessor
+            //aka mandate that everything has to be a part of the loop
+            for (auto pred : blockGraph.IsEntry(base) ? blockGraph.Callers(base) : blockGraph.Predecessors(base))
+            {
+                count(i, pred, preCount, preDependents);
+            }
+            //check if there is a valid successor, a ret continues in the callers
+            for (auto suc : blockGraph.IsReturn(base) ? blockGraph.Callers(base) : blockGraph.Successors(base))
+            {
+                count(i, suc, sucCount, sucDependents);
+            }
+        }
+
+        vector<bool> removed(n, false);
+        vector<size_t> worklist;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (preCount[i] == 0 || sucCount[i] == 0)
+            {
+                worklist.push_back(i);
+            }
+        }
+        while (!worklist.empty())
+        {
+            size_t i = worklist.back();
+            worklist.pop_back();
+            if (removed[i])
+            {
+                continue;
+            }
+            removed[i] = true;
+            for (auto dependent : preDependents[i])
+            {
+                if (!removed[dependent] && --preCount[dependent] == 0)
+                {
+                    worklist.push_back(dependent);
+                }
+            }
+            for (auto dependent : sucDependents[i])
+            {
+                if (!removed[dependent] && --sucCount[dependent] == 0)
+                {
+                    worklist.push_back(dependent);
+                }
+            }
+        }
+
+        set<int64_t> result;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!removed[i])
+            {
+                result.insert(result.end(), blocks[i]);
+            }
+        }
+        return result;
+    }
+
     std::set<std::set<int64_t>> Process(const std::set<std::set<int64_t>> &type25Kernels)
     {
         indicators::ProgressBar bar;
@@ -23,91 +106,13 @@ namespace TypeThree
         uint64_t total = type25Kernels.size();
         int status = 0;
 
-        set<set<int64_t>> result;
-        for (auto kernel : type25Kernels)
-        {
-            bool change = true;
-            while (change)
-            {
-                change = false;
-                for (auto block : kernel)
-                {
-                    BasicBlock *base = blockMap[block];
-                    Function *F = base->getParent();
-                    Instruction *term = base->getTerminator();
-                    bool preFound = false;
-                    bool sucFound = false;
-                    if (base == &F->getEntryBlock())
-                    {
-                        for (auto user : F->users())
-                        {
-                            if (auto *cb = dyn_cast<CallBase>(user))
-                            {
-                                BasicBlock *par = cb->getParent();
-                                int64_t id = GetBlockID(par);
-                                if (kernel.find(id) != kernel.end())
-                                {
-                                    preFound = true;
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        //check if there is a valid predecessor
-                        //aka mandate that everything has to be a part of the loop
-                        for (auto pred : predecessors(base))
-                        {
-                            int64_t id = GetBlockID(pred);
-                            if (kernel.find(id) != kernel.end())
-                            {
-                                preFound = true;
-                                break;
-                            }
-                        }
-                    }
-
-                    if (isa<ReturnInst>(term)) //check if a ret
-                    {
-                        for (auto user : F->users())
-                        {
-                            if (auto *cb = dyn_cast<CallBase>(user))
-                            {
-                                BasicBlock *par = cb->getParent();
-                                int64_t id = GetBlockID(par);
-                                if (kernel.find(id) != kernel.end())
-                                {
-                                    sucFound = true;
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    else
-                    {
-                        //check if there is a valid successor
-                        //aka mandate that everything has to be a part of the loop
-                        for (auto suc : successors(base))
-                        {
-                            int64_t id = GetBlockID(suc);
-                            if (kernel.find(id) != kernel.end())
-                            {
-                                sucFound = true;
-                                break;
-                            }
-                        }
-                    }
-
-                    if (!preFound || !sucFound)
-                    {
-                        kernel.erase(block);
-                        change = true;
-                        break;
-                    }
-                }
-            }
-            result.insert(kernel);
+        //the kernels are independent and the block graph is only read, so they are pruned concurrently
+        vector<set<int64_t>> kernels(type25Kernels.begin(), type25Kernels.end());
+        vector<set<int64_t>> pruned(kernels.size());
+        mutex progress;
+        ParallelFor(kernels.size(), [&](size_t i) {
+            pruned[i] = Prune(kernels[i]);
+            lock_guard<mutex> guard(progress);
             status++;
             if (!noBar)
             {
@@ -115,7 +120,8 @@ namespace TypeThree
                 bar.set_option(indicators::option::PostfixText{"Kernel " + to_string(status) + "/" + to_string(total)});
                 bar.set_progress(percent);
             }
-        }
+        });
+        set<set<int64_t>> result(pruned.begin(), pruned.end());
 
         if (!noBar && !bar.is_completed())
         {
@@ -1,8 +1,11 @@
 #include "TypeTwo.h"
 #include "AtlasUtil/Exceptions.h"
+#include "AtlasUtil/Traces.h"
 #include "cartographer.h"
+#include <algorithm>
 #include <set>
 #include <string>
+#include <vector>
 
 using namespace std;
 using namespace llvm;
@@ -11,18 +14,59 @@ namespace TypeTwo
 {
     uint64_t blockCount = 0;
 
-    int *openCount = nullptr;
-    set<int64_t> *finalBlocks = nullptr;
-    set<int> *kernelMap = nullptr;
-    set<int64_t> openBlocks;
-    int *kernelStarts = nullptr;
-    set<int64_t> *blocks = nullptr;
+    /// <summary>
+    /// Everything is indexed by block ID or kernel index, so the work of an event only depends on the kernels of its block.
+    /// </summary>
+    vector<int> openCount;                 // counter to know where we are in the callstack
+    vector<vector<int>> kernelMap;         // the kernels of every block
+    vector<vector<uint64_t>> finalBlocks;  // final kernel definitions, a bitset over the blocks for every kernel
+    vector<int64_t> kernelStarts;          // map of a kernel index to the first block seen
+    /// <summary>
+    /// The blocks that are open and the kernels that hold one of them. Every kernel with an open block takes the blocks that are entered.
+    /// </summary>
+    vector<int64_t> openBlocks;
+    vector<size_t> openIndex;
+    vector<uint32_t> kernelOpenCount;
+    vector<int> activeKernels;
+    vector<size_t> activeIndex;
+    /// <summary>
+    /// The blocks in the order they were last entered, newest first, as a linked list over the block IDs.
+    /// The blocks a kernel has pending are those entered after kernelSince of the kernel, so they are the head of the list.
+    /// </summary>
+    vector<uint64_t> lastSeen;
+    vector<int64_t> olderBlock;
+    vector<int64_t> newerBlock;
+    int64_t newestBlock = -1;
+    vector<uint64_t> kernelSince;
+    uint64_t now = 0;
+    uint64_t skipTime = 0;
 
     bool blocksLabeled = false;
     vector<string> currentKernel;
     std::set<std::set<int64_t>> kernels;
+
+    void Mark(int kernel, int64_t block)
+    {
+        auto &bits = finalBlocks[(size_t)kernel];
+        if (bits.empty())
+        {
+            bits.resize((blockCount + 63) / 64);
+        }
+        bits[(size_t)block >> 6] |= (uint64_t)1 << (block & 63);
+    }
+
+    template <typename T>
+    void Remove(vector<T> &list, vector<size_t> &index, T value)
+    {
+        auto last = list.back();
+        list[index[(size_t)value]] = last;
+        index[(size_t)last] = index[(size_t)value];
+        list.pop_back();
+    }
+
     void Setup(llvm::Module *bitcode, std::set<std::set<int64_t>> k)
     {
+        blockCount = 0;
         for (auto &mi : *bitcode)
         {
             for (auto fi = mi.begin(); fi != mi.end(); fi++)
@@ -33,95 +77,162 @@ namespace TypeTwo
 
         kernels = move(k);
 
-        openCount = (int *)calloc(sizeof(int), blockCount);                         // counter to know where we are in the callstack
-        finalBlocks = (set<int64_t> *)calloc(sizeof(set<int64_t>), kernels.size()); // final kernel definitions
-        kernelStarts = (int *)calloc(sizeof(int), kernels.size());                  // map of a kernel index to the first block seen
-        blocks = (set<int64_t> *)calloc(sizeof(set<int64_t>), kernels.size());      // temporary kernel blocks
-        kernelMap = (set<int> *)calloc(sizeof(set<int>), blockCount);
-        for (uint32_t i = 0; i < blockCount; i++)
-        {
-            kernelMap[i] = set<int>();
-            openCount[i] = 0;
-        }
-        for (uint32_t i = 0; i < kernels.size(); i++)
-        {
-            blocks[i] = set<int64_t>();
-            finalBlocks[i] = set<int64_t>();
-            kernelStarts[i] = -1;
-        }
+        openCount.assign(blockCount, 0);
+        openIndex.assign(blockCount, 0);
+        kernelMap.assign(blockCount, vector<int>());
+        lastSeen.assign(blockCount, 0);
+        olderBlock.assign(blockCount, -1);
+        newerBlock.assign(blockCount, -1);
+        newestBlock = -1;
+        now = 0;
+        skipTime = 0;
+        openBlocks.clear();
+        activeKernels.clear();
+        finalBlocks.assign(kernels.size(), vector<uint64_t>());
+        kernelStarts.assign(kernels.size(), -1);
+        kernelOpenCount.assign(kernels.size(), 0);
+        activeIndex.assign(kernels.size(), 0);
+        kernelSince.assign(kernels.size(), 0);
         int a = 0;
         for (const auto &kernel : kernels)
         {
             for (auto block : kernel)
             {
-                kernelMap[block].insert(a);
+                kernelMap[(size_t)block].push_back(a);
             }
             a++;
         }
     }
-    void Process(std::string &key, std::string &value)
+    void Process(const TraceEvent &event)
     {
-        if (key == "BBEnter")
+        switch (event.op)
         {
-            int block = stoi(value, nullptr, 0);
-            openCount[block]++; //mark this block as being entered
-            openBlocks.insert(block);
-
-            for (uint64_t i = 0; i < kernels.size(); i++)
+            case TraceOp::BBEnter:
             {
-                blocks[i].insert(block);
-            }
-            if (!blocksLabeled && !currentKernel.empty())
-            {
-                for (const auto &k : currentKernel)
+                auto block = (int64_t)event.number;
+                //mark this block as being entered
+                if (openCount[(size_t)block]++ == 0)
                 {
-                    blockLabelMap[block].insert(k);
+                    openIndex[(size_t)block] = openBlocks.size();
+                    openBlocks.push_back(block);
+                    for (auto ki : kernelMap[(size_t)block])
+                    {
+                        if (kernelOpenCount[(size_t)ki]++ == 0)
+                        {
+                            activeIndex[(size_t)ki] = activeKernels.size();
+                            activeKernels.push_back(ki);
+                        }
+                    }
+                }
+
+                //move the block to the head of the entered blocks
+                lastSeen[(size_t)block] = ++now;
+                if (newestBlock != block)
+                {
+                    if (newerBlock[(size_t)block] != -1)
+                    {
+                        olderBlock[(size_t)newerBlock[(size_t)block]] = olderBlock[(size_t)block];
+                    }
+                    if (olderBlock[(size_t)block] != -1)
+                    {
+                        newerBlock[(size_t)olderBlock[(size_t)block]] = newerBlock[(size_t)block];
+                    }
+                    olderBlock[(size_t)block] = newestBlock;
+                    newerBlock[(size_t)block] = -1;
+                    if (newestBlock != -1)
+                    {
+                        newerBlock[(size_t)newestBlock] = block;
+                    }
+                    newestBlock = block;
+                }
+
+                if (!blocksLabeled && !currentKernel.empty())
+                {
+                    for (const auto &k : currentKernel)
+                    {
+                        blockLabelMap[block].insert(k);
+                    }
+                }
+
+                for (auto ki : activeKernels)
+                {
+                    Mark(ki, block);
                 }
-            }
 
-            for (auto open : openBlocks)
+                for (auto ki : kernelMap[(size_t)block])
+                {
+                    if (kernelStarts[(size_t)ki] == -1)
+                    {
+                        kernelStarts[(size_t)ki] = block;
+                        Mark(ki, block);
+                    }
+                    if (kernelStarts[(size_t)ki] != block)
+                    {
+                        //every block entered since the kernel was last visited
+                        uint64_t since = std::max(kernelSince[(size_t)ki], skipTime);
+                        for (int64_t pending = newestBlock; pending != -1 && lastSeen[(size_t)pending] > since; pending = olderBlock[(size_t)pending])
+                        {
+                            Mark(ki, pending);
+                        }
+                    }
+                    kernelSince[(size_t)ki] = now;
+                }
+                break;
+            }
+            case TraceOp::BBExit:
             {
-                for (auto ki : kernelMap[open])
+                auto block = (int64_t)event.number;
+                //a sampled trace may have skipped the entrance
+                if (openCount[(size_t)block] == 0)
+                {
+                    return;
+                }
+                openCount[(size_t)block]--;
+                if (openCount[(size_t)block] == 0)
                 {
-                    finalBlocks[ki].insert(block);
+                    Remove(openBlocks, openIndex, block);
+                    for (auto ki : kernelMap[(size_t)block])
+                    {
+                        if (--kernelOpenCount[(size_t)ki] == 0)
+                        {
+                            Remove(activeKernels, activeIndex, ki);
+                        }
+                    }
                 }
+                break;
             }
-
-            for (auto ki : kernelMap[block])
+            case TraceOp::Skip:
             {
-
-                if (kernelStarts[ki] == -1)
+                //the blocks around a gap of a sampled trace are unrelated, so nothing carries over it
+                for (auto open : openBlocks)
                 {
-                    kernelStarts[ki] = block;
-                    finalBlocks[ki].insert(block);
+                    openCount[(size_t)open] = 0;
                 }
-                if (kernelStarts[ki] != block)
+                openBlocks.clear();
+                for (auto ki : activeKernels)
                 {
-                    finalBlocks[ki].insert(blocks[ki].begin(), blocks[ki].end());
+                    kernelOpenCount[(size_t)ki] = 0;
                 }
-                blocks[ki].clear();
+                activeKernels.clear();
+                skipTime = now;
+                break;
             }
-        }
-        else if (key == "BBExit")
-        {
-            int block = stoi(value, nullptr, 0);
-            openCount[block]--;
-            if (openCount[block] == 0)
+            case TraceOp::KernelEnter:
             {
-                openBlocks.erase(block);
+                currentKernel.emplace_back(event.data);
+                break;
             }
-        }
-        else if (key == "KernelEnter")
-        {
-            currentKernel.push_back(value);
-        }
-        else if (key == "KernelExit")
-        {
-            if (currentKernel.back() != value)
+            case TraceOp::KernelExit:
             {
-                throw AtlasException("Kernel Entrance/Exit not Matched");
+                if (currentKernel.back() != event.data)
+                {
+                    throw AtlasException("Kernel Entrance/Exit not Matched");
+                }
+                currentKernel.pop_back();
+                break;
             }
-            currentKernel.pop_back();
+            default:
+                break;
         }
     }
 
@@ -132,16 +243,30 @@ namespace TypeTwo
             blocksLabeled = true;
         }
         std::set<set<int64_t>> finalSets;
-        for (uint64_t i = 0; i < kernels.size(); i++)
+        for (const auto &bits : finalBlocks)
         {
-            finalSets.insert(finalBlocks[i]);
+            set<int64_t> kernel;
+            for (size_t word = 0; word < bits.size(); word++)
+            {
+                for (size_t bit = 0; bit < 64; bit++)
+                {
+                    if ((bits[word] >> bit) & 1)
+                    {
+                        kernel.insert((int64_t)(word * 64 + bit));
+                    }
+                }
+            }
+            finalSets.insert(kernel);
         }
-        free(openCount);
-        free(finalBlocks);
-        free(kernelStarts);
-        free(blocks);
-        free(kernelMap);
+        openCount.clear();
+        finalBlocks.clear();
+        kernelStarts.clear();
+        kernelMap.clear();
+        lastSeen.clear();
+        olderBlock.clear();
+        newerBlock.clear();
         openBlocks.clear();
+        activeKernels.clear();
         currentKernel.clear();
         return finalSets;
     }
@@ -1,14 +1,16 @@
 #include "AtlasUtil/Annotate.h"
+#include "AtlasUtil/Profile.h"
+#include "AtlasUtil/TraceFanOut.h"
 #include "AtlasUtil/Traces.h"
 #include "TypeFour.h"
 #include "TypeOne.h"
 #include "TypeThree.h"
 #include "TypeTwo.h"
+#include "cartographer.h"
 #include "dot.h"
 #include "profile.h"
 #include <functional>
 #include <llvm/Bitcode/BitcodeReader.h>
-#include <llvm/IR/CFG.h>
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/CommandLine.h>
 #include <llvm/Support/SourceMgr.h>
@@ -26,6 +28,7 @@ bool noProgressBar;
 bool blocksLabeled = false;
 map<int64_t, set<string>> blockLabelMap;
 map<int64_t, BasicBlock *> blockMap;
+BlockGraph blockGraph;
 set<int64_t> ValidBlocks;
 
 llvm::cl::opt<string> inputTrace("i", llvm::cl::desc("Specify the input trace filename"), llvm::cl::value_desc("trace filename"));
@@ -40,61 +43,26 @@ cl::opt<int> LogLevel("v", cl::desc("Logging level"), cl::value_desc("logging le
 cl::opt<string> LogFile("l", cl::desc("Specify log filename"), cl::value_desc("log file"));
 cl::opt<string> DotFile("d", cl::desc("Specify dot filename"), cl::value_desc("dot file"));
 cl::opt<string> DumpFile("D", cl::desc("Block relationship file"), cl::value_desc("Relationship file"));
+cl::opt<string> edgeFile("e", cl::desc("Specify an edge profile resolved by edgeResolver to analyze in place of the trace"), cl::value_desc("edge profile filename"));
+cl::opt<string> countFile("c", cl::desc("Specify a block count profile to use instead of the trace block counts"), cl::value_desc("profile filename"));
 
-void Dump(const string &dump, Module *M)
+void Dump(const string &dump)
 {
     nlohmann::json dumpJson;
-    for (auto &mi : *M)
+    for (int64_t id = 0; id < (int64_t)blockGraph.Size(); id++)
     {
-        for (auto &fi : mi)
+        if (blockGraph.Block(id) == nullptr)
         {
-            auto BB = cast<BasicBlock>(&fi);
-            auto id = GetBlockID(BB);
-            set<int64_t> blocks;
-            for (auto suc : successors(BB))
-            {
-                blocks.insert(GetBlockID(suc));
-            }
-
-            for (auto &bi : fi)
-            {
-                if (auto i = dyn_cast<CallBase>(&bi))
-                {
-                    auto F = i->getCalledFunction();
-                    if (F != nullptr && !F->empty())
-                    {
-                        auto entry = &F->getEntryBlock();
-                        blocks.insert(GetBlockID(entry));
-                    }
-                }
-            }
-
-            auto term = BB->getTerminator();
-            if (auto ret = dyn_cast<ReturnInst>(term))
-            {
-                auto F = BB->getParent();
-                for (auto user : F->users())
-                {
-                    if (auto i = dyn_cast<CallBase>(user))
-                    {
-                        blocks.insert(GetBlockID(i->getParent()));
-                    }
-                }
-            }
-            else if (auto res = dyn_cast<ResumeInst>(term))
-            {
-                auto F = BB->getParent();
-                for (auto user : F->users())
-                {
-                    if (auto i = dyn_cast<CallBase>(user))
-                    {
-                        blocks.insert(GetBlockID(i->getParent()));
-                    }
-                }
-            }
-
-            dumpJson[to_string(id)] = blocks;
+            continue;
         }
+        set<int64_t> blocks;
+        auto successors = blockGraph.Successors(id);
+        blocks.insert(successors.begin(), successors.end());
+        auto calls = blockGraph.Calls(id);
+        blocks.insert(calls.begin(), calls.end());
+        auto returns = blockGraph.Returns(id);
+        blocks.insert(returns.begin(), returns.end());
+        dumpJson[to_string(id)] = blocks;
     }
     ofstream oStream(dump);
     oStream << dumpJson;
@@ -180,31 +148,72 @@ int main(int argc, char **argv)
             blockMap[id] = bb;
         }
     }
+    //the edges of the module are indexed once for the kernel passes
+    blockGraph = BlockGraph(M);
 
     try
     {
         spdlog::info("Started analysis");
-        ProcessTrace(inputTrace, &TypeOne::Process, "Detecting type 1 kernels", noBar);
+        //the trace is decoded once, the type 2 passes replay the block events cached while type 1 kernels are detected
+        TraceCache cache({TraceOp::BBEnter, TraceOp::BBExit, TraceOp::Skip, TraceOp::KernelEnter, TraceOp::KernelExit});
+        if (edgeFile.empty())
+        {
+            try
+            {
+                FanOutTrace(inputTrace, {{&TypeOne::Process, true}, cache.Consumer()}, "Detecting type 1 kernels", noBar);
+            }
+            catch (...)
+            {
+                //the threads of type 1 must not outlive the analysis
+                TypeOne::Finish();
+                throw;
+            }
+            TypeOne::Finish();
+            double scale = TypeOne::ScaleSampledCounts();
+            if (scale != 1.0)
+            {
+                spdlog::info("Scaled the block counts of the sampled trace by " + to_string(scale));
+            }
+        }
+        else
+        {
+            TypeOne::ProcessEdgeProfile(edgeFile);
+        }
+        if (!countFile.empty())
+        {
+            TypeOne::SetBlockCounts(ReadBlockProfile(countFile));
+        }
         auto type1Kernels = TypeOne::Get();
         spdlog::info("Detected " + to_string(type1Kernels.size()) + " type 1 kernels");
 
-        for (auto &[block, count] : TypeOne::blockCount)
+        for (size_t block = 0; block < TypeOne::blockCount.size(); block++)
         {
-            if (count != 0)
+            if (TypeOne::blockCount[block] != 0)
             {
-                ValidBlocks.insert(block);
+                ValidBlocks.insert((int64_t)block);
             }
         }
 
-        TypeTwo::Setup(M, type1Kernels);
-        ProcessTrace(inputTrace, &TypeTwo::Process, "Detecting type 2 kernels", noBar);
-        auto type2Kernels = TypeTwo::Get();
-        spdlog::info("Detected " + to_string(type2Kernels.size()) + " type 2 kernels");
+        set<set<int64_t>> type2Kernels;
+        set<set<int64_t>> type25Kernels;
+        if (edgeFile.empty())
+        {
+            TypeTwo::Setup(M, type1Kernels);
+            cache.Replay(&TypeTwo::Process, "Detecting type 2 kernels", noBar);
+            type2Kernels = TypeTwo::Get();
+            spdlog::info("Detected " + to_string(type2Kernels.size()) + " type 2 kernels");
 
-        TypeTwo::Setup(M, type2Kernels);
-        ProcessTrace(inputTrace, &TypeTwo::Process, "Detecting type 2.5 kernels", noBar);
-        auto type25Kernels = TypeTwo::Get();
-        spdlog::info("Detected " + to_string(type25Kernels.size()) + " type 2.5 kernels");
+            TypeTwo::Setup(M, type2Kernels);
+            cache.Replay(&TypeTwo::Process, "Detecting type 2.5 kernels", noBar);
+            type25Kernels = TypeTwo::Get();
+            spdlog::info("Detected " + to_string(type25Kernels.size()) + " type 2.5 kernels");
+        }
+        else
+        {
+            //type 2 kernels follow the order of the trace, which an edge profile does not have
+            type2Kernels = type1Kernels;
+            type25Kernels = type1Kernels;
+        }
 
         auto type3Kernels = TypeThree::Process(type25Kernels);
         spdlog::info("Detected " + to_string(type3Kernels.size()) + " type 3 kernels");
@@ -266,9 +275,12 @@ int main(int argc, char **argv)
         //outputJson["BlockCounts"] = TypeOne::blockCount;
         {
             map<string, uint64_t> t;
-            for (const auto &a : TypeOne::blockCount)
+            for (size_t block = 0; block < TypeOne::blockCount.size(); block++)
             {
-                t[to_string(a.first)] = a.second;
+                if (TypeOne::blockCount[block] != 0)
+                {
+                    t[to_string(block)] = TypeOne::blockCount[block];
+                }
             }
             outputJson["BlockCounts"] = t;
         }
@@ -371,7 +383,7 @@ int main(int argc, char **argv)
         }
         if (!DumpFile.empty())
         {
-            Dump(DumpFile, M);
+            Dump(DumpFile);
         }
     }
     catch (AtlasException e)
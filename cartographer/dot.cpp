@@ -1,8 +1,6 @@
 #include "dot.h"
-#include "AtlasUtil/Annotate.h"
 #include "AtlasUtil/Exceptions.h"
 #include "cartographer.h"
-#include <llvm/IR/CFG.h>
 
 using namespace std;
 using namespace llvm;
@@ -85,27 +83,16 @@ string GenerateDot(const set<set<int64_t>> &kernels)
     }
     for (auto b : allBlocks)
     {
-        auto block = blockMap[b];
-        for (auto suc : successors(block))
+        for (auto suc : blockGraph.Successors(b))
         {
-            auto sucBlock = GetBlockID(suc);
-            if (allBlocks.find(sucBlock) != allBlocks.end())
+            if (allBlocks.find(suc) != allBlocks.end())
             {
-                result += "\t" + to_string(b) + " -> " + to_string(sucBlock) + ";\n";
+                result += "\t" + to_string(b) + " -> " + to_string(suc) + ";\n";
             }
         }
-        for (auto bi = block->begin(); bi != block->end(); bi++)
+        for (auto entry : blockGraph.Calls(b))
         {
-            if (auto ci = dyn_cast<CallInst>(bi))
-            {
-                auto F = ci->getCalledFunction();
-                if (F != nullptr && !F->empty())
-                {
-                    BasicBlock *entry = &F->getEntryBlock();
-                    auto id = GetBlockID(entry);
-                    result += "\t" + to_string(b) + " -> " + to_string(id) + " [style=dashed];\n";
-                }
-            }
+            result += "\t" + to_string(b) + " -> " + to_string(entry) + " [style=dashed];\n";
         }
     }
     result += "}";
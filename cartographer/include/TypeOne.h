@@ -1,11 +1,41 @@
+#include "AtlasUtil/TraceEvent.h"
+#include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 using namespace std;
 
 namespace TypeOne
 {
-    void Process(std::string &key, std::string &value);
+    /// <summary>
+    /// Takes the next event of the trace. The co-occurrence counts are accumulated on a pool of threads, one shard of the trace at a time.
+    /// </summary>
+    void Process(const TraceEvent &event);
+    /// <summary>
+    /// Waits for the pool once the trace is done and merges the partial counts of its threads.
+    /// </summary>
+    void Finish();
+    /// <summary>
+    /// Takes the block and edge counts of a profile resolved by edgeResolver in place of a trace.
+    /// </summary>
+    void ProcessEdgeProfile(const std::string &profileFile);
+    /// <summary>
+    /// Scales the block counts of a sampled trace up to the whole run, by the ratio of all blocks to the recorded ones.
+    /// </summary>
+    /// <returns>The scale, 1 if the trace was not sampled.</returns>
+    double ScaleSampledCounts();
     std::set<std::set<int64_t>> Get();
-    extern std::map<int64_t, uint64_t> blockCount;
+    /// <summary>
+    /// The number of times the block was entered, 0 for blocks that never were.
+    /// </summary>
+    uint64_t BlockCount(int64_t block);
+    /// <summary>
+    /// Replaces the block counts, for instance with those of a block profile.
+    /// </summary>
+    void SetBlockCounts(const std::map<int64_t, uint64_t> &counts);
+    /// <summary>
+    /// The execution count of every block, indexed by block ID.
+    /// </summary>
+    extern std::vector<uint64_t> blockCount;
 } // namespace TypeOne
\ No newline at end of file
@@ -1,10 +1,11 @@
 #pragma once
+#include "AtlasUtil/TraceEvent.h"
 #include <llvm/IR/Module.h>
 #include <set>
 #include <string>
 namespace TypeTwo
 {
     void Setup(llvm::Module *bitcode, std::set<std::set<int64_t>> k);
-    void Process(std::string &key, std::string &value);
+    void Process(const TraceEvent &event);
     std::set<std::set<int64_t>> Get();
 } // namespace TypeTwo
\ No newline at end of file
@@ -1,4 +1,5 @@
 #pragma once
+#include "AtlasUtil/BlockGraph.h"
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/Support/CommandLine.h>
 #include <map>
@@ -11,4 +12,5 @@ extern llvm::cl::opt<int> hotThreshold;
 extern bool blocksLabeled;
 extern std::map<int64_t, std::set<std::string>> blockLabelMap;
 extern std::map<int64_t, llvm::BasicBlock *> blockMap;
+extern BlockGraph blockGraph;
 extern std::set<int64_t> ValidBlocks;
\ No newline at end of file
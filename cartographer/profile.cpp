@@ -36,7 +36,7 @@ map<string, map<string, map<string, int>>> ProfileKernels(const std::map<int, st
         auto blocks = kernel.second;
         for (auto block : blocks)
         {
-            uint64_t count = TypeOne::blockCount[block];
+            uint64_t count = TypeOne::BlockCount(block);
             for (const auto &pair : rMap[block])
             {
                 cPigData[iString][pair.first] += pair.second * count;
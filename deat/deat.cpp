@@ -67,38 +67,44 @@ string getKernel(int64_t block)
 }
 
 int64_t block;
-void Process(string &key, string &value)
+void Process(const TraceEvent &event)
 {
-    if (key == "BBEnter")
+    switch (event.op)
     {
-        block = stol(value, nullptr, 0);
-        auto k = getKernel(block);
-        while (k != ck)
+        case TraceOp::BBEnter:
         {
-            //we have changed kernel contexts
-            if (kernelMap[k].find(block) == kernelMap[k].end())
+            block = (int64_t)event.number;
+            auto k = getKernel(block);
+            while (k != ck)
             {
-                //we have left the kernel
-                kernelQueue.pop();
-                k = kernelQueue.back().name;
-            }
-            else
-            {
-                //we have entered a nested kernel
-                ck = k;
-                kernelQueue.push(UIDStruct(ck));
+                //we have changed kernel contexts
+                if (kernelMap[k].find(block) == kernelMap[k].end())
+                {
+                    //we have left the kernel
+                    kernelQueue.pop();
+                    k = kernelQueue.back().name;
+                }
+                else
+                {
+                    //we have entered a nested kernel
+                    ck = k;
+                    kernelQueue.push(UIDStruct(ck));
+                }
             }
+            break;
         }
-    }
-    else if (key == "LoadAddress")
-    {
-        uint64_t address = stoul(value, nullptr, 0);
-        readMap[kernelQueue.back().UID].insert(writeMap[address]);
-    }
-    else if (key == "StoreAddress")
-    {
-        uint64_t address = stoul(value, nullptr, 0);
-        writeMap[address] = kernelQueue.back().UID;
+        case TraceOp::LoadAddress:
+        {
+            readMap[kernelQueue.back().UID].insert(writeMap[event.number]);
+            break;
+        }
+        case TraceOp::StoreAddress:
+        {
+            writeMap[event.number] = kernelQueue.back().UID;
+            break;
+        }
+        default:
+            break;
     }
 }
 
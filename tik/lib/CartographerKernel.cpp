@@ -11,15 +11,24 @@
 #include <nlohmann/json.hpp>
 #include <queue>
 #include <spdlog/spdlog.h>
+#include <unordered_set>
 
 using namespace std;
 using namespace llvm;
 namespace TraceAtlas::tik
 {
-    std::set<GlobalVariable *> globalDeclarationSet;
-    std::set<Value *> remappedOperandSet;
-    std::map<int64_t, llvm::BasicBlock *> IDToBlock;
-    std::map<int64_t, llvm::Value *> IDToValue;
+    thread_local std::set<GlobalVariable *> globalDeclarationSet;
+    thread_local std::set<Value *> remappedOperandSet;
+    /// <summary>
+    /// The last operand without a value ID that GetBoundaryValues saw. It stands for every value with the ID -1.
+    /// </summary>
+    thread_local llvm::Value *unidentifiedValue = nullptr;
+
+    Value *GetValue(const ModuleIndex &index, int64_t id)
+    {
+        return id == -1 ? unidentifiedValue : index.GetValue(id);
+    }
+
     void CopyOperand(llvm::User *inst, llvm::ValueToValueMapTy &VMap)
     {
         if (auto func = dyn_cast<Function>(inst))
@@ -131,7 +140,7 @@ namespace TraceAtlas::tik
         }
     }
 
-    CartographerKernel::CartographerKernel(std::vector<int64_t> basicBlocks, llvm::Module *M, std::string name)
+    CartographerKernel::CartographerKernel(std::vector<int64_t> basicBlocks, const ModuleIndex &index, std::string name)
     {
         llvm::ValueToValueMapTy VMap;
         set<int64_t> blockSet;
@@ -144,13 +153,9 @@ namespace TraceAtlas::tik
         {
             Name = "Kernel_" + to_string(KernelUID++);
         }
-        else if (name.front() >= '0' && name.front() <= '9')
-        {
-            Name = "K" + name;
-        }
         else
         {
-            Name = name;
+            Name = GetFunctionName(name);
         }
         if (reservedNames.find(Name) != reservedNames.end())
         {
@@ -160,19 +165,11 @@ namespace TraceAtlas::tik
         reservedNames.insert(Name);
 
         set<BasicBlock *> blocks;
-        for (auto &F : *M)
+        for (auto id : basicBlocks)
         {
-            for (Function::iterator BB = F.begin(), E = F.end(); BB != E; ++BB)
+            if (auto *b = index.GetBlock(id))
             {
-                auto *b = cast<BasicBlock>(BB);
-                int64_t id = GetBlockID(b);
-                if (id != -1)
-                {
-                    if (find(basicBlocks.begin(), basicBlocks.end(), id) != basicBlocks.end())
-                    {
-                        blocks.insert(b);
-                    }
-                }
+                blocks.insert(b);
             }
         }
 
@@ -210,11 +207,11 @@ namespace TraceAtlas::tik
             inputArgs.push_back(Type::getInt8Ty(TikModule->getContext()));
             for (auto inst : KernelImports)
             {
-                inputArgs.push_back(IDToValue[inst]->getType());
+                inputArgs.push_back(GetValue(index, inst)->getType());
             }
             for (auto inst : KernelExports)
             {
-                inputArgs.push_back(IDToValue[inst]->getType());
+                inputArgs.push_back(GetValue(index, inst)->getType());
             }
             FunctionType *funcType = FunctionType::get(Type::getInt8Ty(TikModule->getContext()), inputArgs, false);
             KernelFunction = Function::Create(funcType, GlobalValue::LinkageTypes::ExternalLinkage, Name, TikModule);
@@ -223,7 +220,7 @@ namespace TraceAtlas::tik
             {
                 auto *a = cast<Argument>(KernelFunction->arg_begin() + 1 + i);
                 a->setName("i" + to_string(i));
-                VMap[IDToValue[KernelImports[i]]] = a;
+                VMap[GetValue(index, KernelImports[i])] = a;
                 ArgumentMap[a] = KernelImports[i];
             }
             uint64_t j;
@@ -240,7 +237,7 @@ namespace TraceAtlas::tik
             Exception = BasicBlock::Create(TikModule->getContext(), "Exception", KernelFunction);
 
             //copy the appropriate blocks
-            BuildKernelFromBlocks(VMap, blocks);
+            BuildKernelFromBlocks(index, VMap, blocks);
 
             Remap(VMap); //we need to remap before inlining
 
@@ -271,13 +268,13 @@ namespace TraceAtlas::tik
                 }
             }
 
-            BuildInit(VMap);
+            BuildInit(index, VMap);
 
-            BuildExit();
+            BuildExit(index);
 
-            RemapNestedKernels(VMap);
+            RemapNestedKernels(index, VMap);
 
-            RemapExports(VMap, KernelExports);
+            RemapExports(index, VMap, KernelExports);
 
             PatchPhis();
 
@@ -307,6 +304,15 @@ namespace TraceAtlas::tik
         }
     }
 
+    std::string CartographerKernel::GetFunctionName(const std::string &name)
+    {
+        if (name.front() >= '0' && name.front() <= '9')
+        {
+            return "K" + name;
+        }
+        return name;
+    }
+
     void CartographerKernel::GetBoundaryValues(set<BasicBlock *> &blocks, vector<int64_t> &KernelImports, vector<int64_t> &KernelExports)
     {
         //we start with entrances
@@ -314,9 +320,17 @@ namespace TraceAtlas::tik
         int entranceId = 0;
         for (auto e : ent)
         {
-            IDToBlock[GetBlockID(e)] = e;
             Entrances.insert(make_shared<KernelInterface>(entranceId++, GetBlockID(e)));
         }
+        // hashed copies of the blocks and the imports so every operand and user is checked in constant time
+        unordered_set<BasicBlock *> blockSet(blocks.begin(), blocks.end());
+        unordered_set<int64_t> importSet;
+        auto addImport = [&](int64_t id) {
+            if (importSet.insert(id).second)
+            {
+                KernelImports.push_back(id);
+            }
+        };
         for (auto block : blocks)
         {
             //we now finally ask for the external values
@@ -330,17 +344,16 @@ namespace TraceAtlas::tik
                 for (uint32_t i = 0; i < numOps; i++)
                 {
                     Value *op = inst->getOperand(i);
-                    // initialize IDToValue
-                    IDToValue[GetValueID(op)] = op;
+                    if (GetValueID(op) == -1)
+                    {
+                        unidentifiedValue = op;
+                    }
                     if (auto *operand = dyn_cast<Instruction>(op))
                     {
                         BasicBlock *parentBlock = operand->getParent();
-                        if (std::find(blocks.begin(), blocks.end(), parentBlock) == blocks.end())
+                        if (blockSet.find(parentBlock) == blockSet.end())
                         {
-                            if (find(KernelImports.begin(), KernelImports.end(), GetValueID(operand)) == KernelImports.end())
-                            {
-                                KernelImports.push_back(GetValueID(operand));
-                            }
+                            addImport(GetValueID(operand));
                         }
                     }
                     else if (auto *ar = dyn_cast<Argument>(op))
@@ -356,19 +369,13 @@ namespace TraceAtlas::tik
                                     //these are the arguments for the function call in order
                                     //we now can check if they are in our vmap, if so they aren't external
                                     //if not they are and should be mapped as is appropriate
-                                    if (find(KernelImports.begin(), KernelImports.end(), sExtVal) == KernelImports.end())
-                                    {
-                                        KernelImports.push_back(sExtVal);
-                                    }
+                                    addImport(sExtVal);
                                 }
                             }
                         }
                         else
                         {
-                            if (find(KernelImports.begin(), KernelImports.end(), GetValueID(ar)) == KernelImports.end())
-                            {
-                                KernelImports.push_back(GetValueID(ar));
-                            }
+                            addImport(GetValueID(ar));
                         }
                     }
                 }
@@ -380,7 +387,7 @@ namespace TraceAtlas::tik
                     if (auto i = dyn_cast<Instruction>(user))
                     {
                         auto p = i->getParent();
-                        if (blocks.find(p) == blocks.end())
+                        if (blockSet.find(p) == blockSet.end())
                         {
                             //the use is external therefore it should be a kernel export
                             KernelExports.push_back(GetValueID(inst));
@@ -400,12 +407,12 @@ namespace TraceAtlas::tik
         }
     }
 
-    void CartographerKernel::BuildKernelFromBlocks(llvm::ValueToValueMapTy &VMap, set<BasicBlock *> &blocks)
+    void CartographerKernel::BuildKernelFromBlocks(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap, set<BasicBlock *> &blocks)
     {
         set<Function *> headFunctions;
         for (const auto &ent : Entrances)
         {
-            BasicBlock *eTarget = IDToBlock[ent->Block];
+            BasicBlock *eTarget = index.GetBlock(ent->Block);
             headFunctions.insert(eTarget->getParent());
         }
 
@@ -428,7 +435,7 @@ namespace TraceAtlas::tik
                 bool inNested = false;
                 for (const auto &ent : nestedKernel->Entrances)
                 {
-                    if (IDToBlock[ent->Block] == block)
+                    if (index.GetBlock(ent->Block) == block)
                     {
                         inNested = true;
                         break;
@@ -462,7 +469,7 @@ namespace TraceAtlas::tik
                         auto sw = intBuilder.CreateSwitch(cc, Exception, (uint32_t)nestedKernel->Exits.size());
                         for (const auto &exit : nestedKernel->Exits)
                         {
-                            sw->addCase(ConstantInt::get(Type::getInt8Ty(TikModule->getContext()), (uint64_t)exit->Index), IDToBlock[exit->Block]);
+                            sw->addCase(ConstantInt::get(Type::getInt8Ty(TikModule->getContext()), (uint64_t)exit->Index), index.GetBlock(exit->Block));
                         }
                         VMap[block] = intermediateBlock;
                     }
@@ -500,7 +507,7 @@ namespace TraceAtlas::tik
                                 bool found = false;
                                 for (const auto &ent : Entrances)
                                 {
-                                    if (IDToBlock[ent->Block] == block)
+                                    if (index.GetBlock(ent->Block) == block)
                                     {
                                         p->replaceIncomingBlockWith(pred, Init);
                                         rescheduled++;
@@ -623,7 +630,7 @@ namespace TraceAtlas::tik
     */
     }
 
-    void CartographerKernel::RemapNestedKernels(llvm::ValueToValueMapTy &VMap)
+    void CartographerKernel::RemapNestedKernels(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap)
     {
         // Now find all calls to the embedded kernel functions in the body, if any, and change their arguments to the new ones
         std::map<Argument *, Value *> embeddedCallArgs;
@@ -644,14 +651,14 @@ namespace TraceAtlas::tik
                                 for (BasicBlock::iterator j = b.begin(), BE2 = b.end(); j != BE2; ++j)
                                 {
                                     auto inst = cast<Instruction>(j);
-                                    auto subArg = IDToValue[subK->ArgumentMap[sarg]];
+                                    auto subArg = GetValue(index, subK->ArgumentMap[sarg]);
                                     if (subArg != nullptr)
                                     {
-                                        if (IDToValue[subK->ArgumentMap[sarg]] == inst)
+                                        if (GetValue(index, subK->ArgumentMap[sarg]) == inst)
                                         {
                                             embeddedCallArgs[sarg] = inst;
                                         }
-                                        else if (VMap[IDToValue[subK->ArgumentMap[sarg]]] == inst)
+                                        else if (VMap[GetValue(index, subK->ArgumentMap[sarg])] == inst)
                                         {
                                             embeddedCallArgs[sarg] = inst;
                                         }
@@ -667,7 +674,7 @@ namespace TraceAtlas::tik
                                 {
                                     embeddedCallArgs[sarg] = arg;
                                 }
-                                else if (VMap[IDToValue[subK->ArgumentMap[sarg]]] == IDToValue[ArgumentMap[arg]])
+                                else if (VMap[GetValue(index, subK->ArgumentMap[sarg])] == GetValue(index, ArgumentMap[arg]))
                                 {
                                     embeddedCallArgs[sarg] = arg;
                                 }
@@ -697,12 +704,12 @@ namespace TraceAtlas::tik
         }
     }
 
-    void CartographerKernel::RemapExports(llvm::ValueToValueMapTy &VMap, vector<int64_t> &KernelExports)
+    void CartographerKernel::RemapExports(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap, vector<int64_t> &KernelExports)
     {
         map<Value *, AllocaInst *> exportMap;
         for (auto ex : KernelExports)
         {
-            Value *mapped = VMap[IDToValue[ex]];
+            Value *mapped = VMap[GetValue(index, ex)];
             if (mapped != nullptr)
             {
                 if (mapped->getNumUses() != 0)
@@ -819,7 +826,7 @@ namespace TraceAtlas::tik
         }
     }
 
-    void CartographerKernel::BuildInit(llvm::ValueToValueMapTy &VMap)
+    void CartographerKernel::BuildInit(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap)
     {
         IRBuilder<> initBuilder(Init);
         auto initSwitch = initBuilder.CreateSwitch(KernelFunction->arg_begin(), Exception, (uint32_t)Entrances.size());
@@ -827,9 +834,9 @@ namespace TraceAtlas::tik
         for (const auto &ent : Entrances)
         {
             int64_t id = ent->Block;
-            if (KernelMap.find(id) == KernelMap.end() && VMap[IDToBlock[ent->Block]] != nullptr)
+            if (KernelMap.find(id) == KernelMap.end() && VMap[index.GetBlock(ent->Block)] != nullptr)
             {
-                initSwitch->addCase(ConstantInt::get(Type::getInt8Ty(TikModule->getContext()), i), cast<BasicBlock>(VMap[IDToBlock[ent->Block]]));
+                initSwitch->addCase(ConstantInt::get(Type::getInt8Ty(TikModule->getContext()), i), cast<BasicBlock>(VMap[index.GetBlock(ent->Block)]));
             }
             else
             {
@@ -839,7 +846,7 @@ namespace TraceAtlas::tik
         }
     }
 
-    void CartographerKernel::BuildExit()
+    void CartographerKernel::BuildExit(const ModuleIndex &index)
     {
         PrintVal(Exit, false); //another sacrifice
         IRBuilder<> exitBuilder(Exit);
@@ -850,7 +857,6 @@ namespace TraceAtlas::tik
         map<BasicBlock *, BasicBlock *> exitMap;
         for (auto exit : ex)
         {
-            IDToBlock[GetBlockID(exit)] = exit;
             Exits.insert(make_shared<KernelInterface>(exitId++, GetBlockID(exit)));
             BasicBlock *tmp = BasicBlock::Create(TikModule->getContext(), "", KernelFunction);
             IRBuilder<> builder(tmp);
@@ -879,7 +885,7 @@ namespace TraceAtlas::tik
         auto phi = exitBuilder.CreatePHI(Type::getInt8Ty(TikModule->getContext()), (uint32_t)Exits.size());
         for (const auto &exit : Exits)
         {
-            phi->addIncoming(ConstantInt::get(Type::getInt8Ty(TikModule->getContext()), (uint64_t)exit->Index), exitMap[IDToBlock[exit->Block]]);
+            phi->addIncoming(ConstantInt::get(Type::getInt8Ty(TikModule->getContext()), (uint64_t)exit->Index), exitMap[index.GetBlock(exit->Block)]);
         }
 
         exitBuilder.CreateRet(phi);
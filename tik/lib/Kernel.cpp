@@ -29,9 +29,9 @@ using namespace std;
 
 namespace TraceAtlas::tik
 {
-    int KernelUID = 0;
+    thread_local int KernelUID = 0;
 
-    set<string> reservedNames;
+    thread_local set<string> reservedNames;
 
     Kernel::~Kernel() = default;
 
@@ -0,0 +1,315 @@
+#include "tik/KernelCache.h"
+#include "AtlasUtil/Annotate.h"
+#include "tik/libtik.h"
+#include <algorithm>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <set>
+#include <spdlog/spdlog.h>
+
+using namespace llvm;
+using namespace std;
+
+namespace TraceAtlas::tik
+{
+    /// <summary>
+    /// Part of every key, changes to the conversion that alter its output have to bump it.
+    /// </summary>
+    constexpr const char *CacheVersion = "tik-kernel-cache-1";
+
+    /// <summary>
+    /// Adds the globals used by the constant to globals, including the ones used by their initializers.
+    /// </summary>
+    static void AddGlobals(Constant *constant, set<GlobalValue *> &globals)
+    {
+        vector<Constant *> toVisit = {constant};
+        while (!toVisit.empty())
+        {
+            Constant *current = toVisit.back();
+            toVisit.pop_back();
+            if (auto *global = dyn_cast<GlobalValue>(current))
+            {
+                if (!globals.insert(global).second)
+                {
+                    continue;
+                }
+                if (auto *var = dyn_cast<GlobalVariable>(global))
+                {
+                    if (var->hasInitializer())
+                    {
+                        toVisit.push_back(var->getInitializer());
+                    }
+                }
+                continue;
+            }
+            for (auto &op : current->operands())
+            {
+                if (auto *c = dyn_cast<Constant>(op))
+                {
+                    toVisit.push_back(c);
+                }
+            }
+        }
+    }
+
+    KernelCache::KernelCache(std::string directory, Module *source, const ModuleIndex &index) : directory(std::move(directory)), source(source), index(index), slots(source)
+    {
+    }
+
+    std::string KernelCache::GetPath(const std::string &key)
+    {
+        return directory + "/" + key + ".bc";
+    }
+
+    std::string KernelCache::GetKey(const std::vector<int64_t> &blocks)
+    {
+        std::string text;
+        raw_string_ostream key(text);
+        key << CacheVersion << "\n"
+            << source->getDataLayoutStr() << "\n"
+            << source->getTargetTriple() << "\n";
+        vector<int64_t> sorted(blocks);
+        std::sort(sorted.begin(), sorted.end());
+        for (auto block : sorted)
+        {
+            key << block << " ";
+        }
+        key << "\n";
+
+        //the functions holding the blocks and every function they may inline, with the globals any of them uses
+        set<GlobalValue *> globals;
+        vector<Function *> toVisit;
+        for (auto block : sorted)
+        {
+            if (auto *b = index.GetBlock(block))
+            {
+                toVisit.push_back(b->getParent());
+            }
+        }
+        while (!toVisit.empty())
+        {
+            Function *F = toVisit.back();
+            toVisit.pop_back();
+            if (!globals.insert(F).second)
+            {
+                continue;
+            }
+            for (auto &BB : *F)
+            {
+                for (auto &inst : BB)
+                {
+                    for (auto &op : inst.operands())
+                    {
+                        if (auto *f = dyn_cast<Function>(op))
+                        {
+                            if (!f->isDeclaration())
+                            {
+                                toVisit.push_back(f);
+                                continue;
+                            }
+                        }
+                        if (auto *c = dyn_cast<Constant>(op))
+                        {
+                            AddGlobals(c, globals);
+                        }
+                    }
+                }
+            }
+        }
+
+        //the printed IR covers the code, the IDs and callers are written out since the metadata only shows up as references
+        for (auto &F : *source)
+        {
+            if (globals.find(&F) == globals.end())
+            {
+                continue;
+            }
+            static_cast<Value &>(F).print(key, slots);
+            for (auto &BB : F)
+            {
+                key << GetBlockID(&BB) << ":";
+                for (auto &inst : BB)
+                {
+                    key << " " << GetValueID(&inst);
+                }
+                key << "\n";
+            }
+            key << "callers:";
+            for (auto user : F.users())
+            {
+                if (auto *cb = dyn_cast<CallBase>(user))
+                {
+                    key << " " << GetBlockID(cb->getParent());
+                }
+            }
+            key << "\n";
+        }
+        for (auto &var : source->globals())
+        {
+            if (globals.find(&var) == globals.end())
+            {
+                continue;
+            }
+            static_cast<Value &>(var).print(key, slots);
+            key << "\n";
+            SmallVector<pair<unsigned, MDNode *>, 1> MDs;
+            var.getAllMetadata(MDs);
+            for (auto &MD : MDs)
+            {
+                MD.second->print(key, slots, source);
+                key << "\n";
+            }
+        }
+        for (auto &alias : source->aliases())
+        {
+            if (globals.find(&alias) != globals.end())
+            {
+                static_cast<Value &>(alias).print(key, slots);
+                key << "\n";
+            }
+        }
+
+        SHA1 hasher;
+        hasher.update(key.str());
+        return toHex(hasher.final(), true);
+    }
+
+    std::unique_ptr<Module> KernelCache::Load(const std::string &key, const std::string &name)
+    {
+        auto path = GetPath(key);
+        auto buffer = MemoryBuffer::getFile(path);
+        if (!buffer)
+        {
+            return nullptr;
+        }
+        auto parsed = parseBitcodeFile(buffer.get()->getMemBufferRef(), TikModule->getContext());
+        if (!parsed)
+        {
+            spdlog::warn("Ignoring the damaged cache entry " + path + ": " + toString(parsed.takeError()));
+            return nullptr;
+        }
+        unique_ptr<Module> entry = move(*parsed);
+        for (auto &F : *entry)
+        {
+            if (!F.isDeclaration())
+            {
+                F.setName(name);
+            }
+        }
+        return entry;
+    }
+
+    void KernelCache::Store(const std::string &key, Function *kernelFunction)
+    {
+        set<GlobalValue *> globals;
+        for (auto &BB : *kernelFunction)
+        {
+            for (auto &inst : BB)
+            {
+                for (auto &op : inst.operands())
+                {
+                    if (auto *c = dyn_cast<Constant>(op))
+                    {
+                        AddGlobals(c, globals);
+                    }
+                }
+            }
+        }
+        globals.erase(kernelFunction);
+
+        //copy the globals in the order of the tik module, then the kernel itself
+        auto entry = make_unique<Module>(TikModule->getName(), TikModule->getContext());
+        entry->setDataLayout(TikModule->getDataLayout());
+        entry->setTargetTriple(TikModule->getTargetTriple());
+        ValueToValueMapTy VMap;
+        for (auto &F : *TikModule)
+        {
+            if (globals.find(&F) != globals.end())
+            {
+                auto linkage = F.hasLocalLinkage() ? GlobalValue::ExternalLinkage : F.getLinkage();
+                auto *copy = Function::Create(F.getFunctionType(), linkage, F.getName(), entry.get());
+                copy->copyAttributesFrom(&F);
+                VMap[&F] = copy;
+                globals.erase(&F);
+            }
+        }
+        vector<pair<GlobalVariable *, GlobalVariable *>> variables;
+        for (auto &var : TikModule->globals())
+        {
+            if (globals.find(&var) != globals.end())
+            {
+                auto *copy = new GlobalVariable(*entry, var.getValueType(), var.isConstant(), var.getLinkage(), nullptr, var.getName(), nullptr, var.getThreadLocalMode(), var.getType()->getAddressSpace());
+                copy->copyAttributesFrom(&var);
+                VMap[&var] = copy;
+                variables.emplace_back(&var, copy);
+                globals.erase(&var);
+            }
+        }
+        if (!globals.empty())
+        {
+            //aliases and the like are never made by tik, a kernel using them is not worth caching
+            return;
+        }
+        for (auto &[var, copy] : variables)
+        {
+            if (var->hasInitializer())
+            {
+                copy->setInitializer(MapValue(var->getInitializer(), VMap));
+            }
+            SmallVector<pair<unsigned, MDNode *>, 1> MDs;
+            var->getAllMetadata(MDs);
+            for (auto &MD : MDs)
+            {
+                copy->addMetadata(MD.first, *MapMetadata(MD.second, VMap));
+            }
+            if (Comdat *SC = var->getComdat())
+            {
+                Comdat *DC = entry->getOrInsertComdat(SC->getName());
+                DC->setSelectionKind(SC->getSelectionKind());
+                copy->setComdat(DC);
+            }
+        }
+        auto *kernel = Function::Create(kernelFunction->getFunctionType(), kernelFunction->getLinkage(), kernelFunction->getName(), entry.get());
+        auto arg = kernel->arg_begin();
+        for (auto &original : kernelFunction->args())
+        {
+            arg->setName(original.getName());
+            VMap[&original] = &*arg++;
+        }
+        SmallVector<ReturnInst *, 8> returns;
+        CloneFunctionInto(kernel, kernelFunction, VMap, true, returns);
+        if (verifyModule(*entry))
+        {
+            spdlog::warn("Not caching kernel " + kernelFunction->getName().str() + ", its copy is broken");
+            return;
+        }
+
+        //written next to the entry and renamed over it, so a concurrent tik never reads half an entry
+        SmallString<128> temporary;
+        int fd;
+        if (sys::fs::createUniqueFile(GetPath(key) + ".%%%%%%", fd, temporary))
+        {
+            spdlog::warn("Failed to create a cache entry in " + directory);
+            return;
+        }
+        {
+            raw_fd_ostream stream(fd, true);
+            WriteBitcodeToFile(*entry, stream, true);
+        }
+        if (sys::fs::rename(temporary, GetPath(key)))
+        {
+            spdlog::warn("Failed to write the cache entry " + GetPath(key));
+            sys::fs::remove(temporary);
+        }
+    }
+} // namespace TraceAtlas::tik
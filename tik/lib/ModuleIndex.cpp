@@ -0,0 +1,49 @@
+#include "tik/ModuleIndex.h"
+#include "AtlasUtil/Annotate.h"
+
+using namespace llvm;
+using namespace std;
+
+namespace TraceAtlas::tik
+{
+    ModuleIndex::ModuleIndex(Module *M)
+    {
+        for (auto &F : *M)
+        {
+            for (auto &BB : F)
+            {
+                int64_t id = GetBlockID(&BB);
+                if (id >= 0)
+                {
+                    if ((uint64_t)id >= blocks.size())
+                    {
+                        blocks.resize((uint64_t)id + 1, nullptr);
+                    }
+                    blocks[(uint64_t)id] = &BB;
+                }
+                for (auto &inst : BB)
+                {
+                    int64_t valueId = GetValueID(&inst);
+                    if (valueId >= 0)
+                    {
+                        if ((uint64_t)valueId >= values.size())
+                        {
+                            values.resize((uint64_t)valueId + 1, nullptr);
+                        }
+                        values[(uint64_t)valueId] = &inst;
+                    }
+                }
+            }
+        }
+    }
+
+    BasicBlock *ModuleIndex::GetBlock(int64_t id) const
+    {
+        return id >= 0 && (uint64_t)id < blocks.size() ? blocks[(uint64_t)id] : nullptr;
+    }
+
+    Value *ModuleIndex::GetValue(int64_t id) const
+    {
+        return id >= 0 && (uint64_t)id < values.size() ? values[(uint64_t)id] : nullptr;
+    }
+} // namespace TraceAtlas::tik
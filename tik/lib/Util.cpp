@@ -1,35 +1,90 @@
 #include "tik/Util.h"
 #include "AtlasUtil/Annotate.h"
 #include "AtlasUtil/Exceptions.h"
+#include <llvm/ADT/SmallString.h>
 #include <llvm/IR/AssemblyAnnotationWriter.h>
 #include <llvm/IR/CFG.h>
 #include <llvm/IR/Instructions.h>
+#include <llvm/IR/ModuleSlotTracker.h>
 #include <llvm/Support/raw_ostream.h>
 #include <queue>
-#include <regex>
 
 using namespace std;
 using namespace llvm;
 
 namespace TraceAtlas::tik
 {
+    /// <summary>
+    /// The characters trimmed off both ends of a rendered value, the ones \s matches.
+    /// </summary>
+    constexpr const char *Whitespace = " \t\n\v\f\r";
+
+    /// <summary>
+    /// Renders instructions like GetString, but shares the slot numbering of their function and the buffer between them.
+    /// Printing an instruction on its own numbers the module and its whole function again, this does it once per function.
+    /// </summary>
+    class StringRenderer
+    {
+    public:
+        string Render(Value *v)
+        {
+            buffer.clear();
+            raw_svector_ostream stream(buffer);
+            auto *inst = dyn_cast<Instruction>(v);
+            if (inst == nullptr || inst->getFunction() == nullptr || ReferencesMDNode(inst))
+            {
+                //these are numbered differently when printed on their own, so they still are
+                v->print(stream);
+            }
+            else
+            {
+                //metadata numbers carry over from one function to the next, so every function starts over like a lone print does
+                if (inst->getFunction() != function)
+                {
+                    function = inst->getFunction();
+                    slots = make_unique<ModuleSlotTracker>(function->getParent(), false);
+                }
+                v->print(stream, *slots);
+            }
+            return StringRef(buffer.data(), buffer.size()).trim(Whitespace).str();
+        }
+
+    private:
+        const Function *function = nullptr;
+        unique_ptr<ModuleSlotTracker> slots;
+        SmallString<256> buffer;
+        static bool ReferencesMDNode(Instruction *inst)
+        {
+            for (auto &op : inst->operands())
+            {
+                if (auto *md = dyn_cast_or_null<MetadataAsValue>(op))
+                {
+                    if (isa<MDNode>(md->getMetadata()))
+                    {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+    };
+
     string GetString(Value *v)
     {
-        std::string str;
-        llvm::raw_string_ostream rso(str);
-        v->print(rso);
-        str = std::regex_replace(str, std::regex("^\\s+"), std::string(""));
-        str = std::regex_replace(str, std::regex("\\s+$"), std::string(""));
-        return str;
+        thread_local SmallString<256> buffer;
+        buffer.clear();
+        raw_svector_ostream stream(buffer);
+        v->print(stream);
+        return StringRef(buffer.data(), buffer.size()).trim(Whitespace).str();
     }
 
     std::vector<std::string> GetStrings(BasicBlock *bb)
     {
         std::vector<std::string> result;
-        for (BasicBlock::iterator BI = bb->begin(), BE = bb->end(); BI != BE; ++BI)
+        StringRenderer renderer;
+        for (auto &inst : *bb)
         {
-            auto *inst = cast<Instruction>(BI);
-            result.push_back(GetString(inst));
+            result.push_back(renderer.Render(&inst));
         }
         return result;
     }
@@ -52,10 +107,12 @@ namespace TraceAtlas::tik
 
     std::vector<std::string> GetStrings(const std::set<Instruction *> &instructions)
     {
-        std::vector<std::string> result(instructions.size());
+        std::vector<std::string> result;
+        result.reserve(instructions.size());
+        StringRenderer renderer;
         for (Instruction *inst : instructions)
         {
-            result.push_back(GetString(inst));
+            result.push_back(renderer.Render(inst));
         }
         return result;
     }
@@ -63,15 +120,29 @@ namespace TraceAtlas::tik
     std::vector<std::string> GetStrings(const std::vector<Instruction *> &instructions)
     {
         std::vector<std::string> result;
+        result.reserve(instructions.size());
+        StringRenderer renderer;
         for (Instruction *inst : instructions)
         {
-            std::string str;
-            llvm::raw_string_ostream rso(str);
-            inst->print(rso);
-            result.push_back(GetString(inst));
+            result.push_back(renderer.Render(inst));
+        }
+        return result;
+    }
+
+    std::vector<std::string> GetInstructionStrings(Function *f)
+    {
+        std::vector<std::string> result;
+        StringRenderer renderer;
+        for (auto &BB : *f)
+        {
+            for (auto &inst : BB)
+            {
+                result.push_back(renderer.Render(&inst));
+            }
         }
         return result;
     }
+
     set<BasicBlock *> GetReachable(BasicBlock *base, set<int64_t> validBlocks)
     {
         bool foundSelf = false;
@@ -1,5 +1,6 @@
 #pragma once
 #include "tik/Kernel.h"
+#include "tik/ModuleIndex.h"
 #include <llvm/IR/Module.h>
 #include <set>
 #include <string>
@@ -10,18 +11,22 @@ namespace TraceAtlas::tik
     class CartographerKernel : public Kernel
     {
     public:
-        CartographerKernel(std::vector<int64_t> basicBlocks, llvm::Module *M, std::string name = "");
+        CartographerKernel(std::vector<int64_t> basicBlocks, const ModuleIndex &index, std::string name = "");
+        /// <summary>
+        /// The name of the function of the kernel called name.
+        /// </summary>
+        static std::string GetFunctionName(const std::string &name);
 
     private:
         CartographerKernel();
         void GetBoundaryValues(std::set<llvm::BasicBlock *> &blocks, std::vector<int64_t> &KernelImports, std::vector<int64_t> &KernelExports);
-        void BuildKernelFromBlocks(llvm::ValueToValueMapTy &VMap, std::set<llvm::BasicBlock *> &blocks);
+        void BuildKernelFromBlocks(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap, std::set<llvm::BasicBlock *> &blocks);
         void InlineFunctionsFromBlocks(std::set<int64_t> &blocks);
-        void RemapNestedKernels(llvm::ValueToValueMapTy &VMap);
-        void RemapExports(llvm::ValueToValueMapTy &VMap, std::vector<int64_t> &KernelExports);
+        void RemapNestedKernels(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap);
+        void RemapExports(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap, std::vector<int64_t> &KernelExports);
         void CopyGlobals(llvm::ValueToValueMapTy &VMap);
-        void BuildInit(llvm::ValueToValueMapTy &VMap);
-        void BuildExit();
+        void BuildInit(const ModuleIndex &index, llvm::ValueToValueMapTy &VMap);
+        void BuildExit(const ModuleIndex &index);
         void PatchPhis();
         void Remap(llvm::ValueToValueMapTy &VMap);
     };
@@ -13,8 +13,8 @@
 
 namespace TraceAtlas::tik
 {
-    extern int KernelUID;
-    extern std::set<std::string> reservedNames;
+    extern thread_local int KernelUID;
+    extern thread_local std::set<std::string> reservedNames;
     class Kernel
     {
     public:
@@ -0,0 +1,43 @@
+#pragma once
+#include "tik/ModuleIndex.h"
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/ModuleSlotTracker.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace TraceAtlas::tik
+{
+    /// <summary>
+    /// An on-disk cache of converted kernels. Every entry is a bitcode module holding one kernel function and the globals it uses,
+    /// named after a hash of everything the conversion reads from the source module, so a changed kernel simply misses.
+    /// Entries are loaded into and extracted from TikModule. Only kernels that share no blocks with other kernels may use the cache,
+    /// the conversion of the others depends on the kernels converted before them.
+    /// </summary>
+    class KernelCache
+    {
+    public:
+        KernelCache(std::string directory, llvm::Module *source, const ModuleIndex &index);
+        /// <summary>
+        /// The key of the kernel made of the blocks. It covers the blocks, the functions holding them or called from them with their IDs,
+        /// the blocks calling those functions and the globals they refer to.
+        /// </summary>
+        std::string GetKey(const std::vector<int64_t> &blocks);
+        /// <summary>
+        /// The module of the entry in the context of TikModule with its kernel function renamed to name, nullptr on a miss.
+        /// </summary>
+        std::unique_ptr<llvm::Module> Load(const std::string &key, const std::string &name);
+        /// <summary>
+        /// Writes the kernel function of TikModule with copies of the globals and declarations it uses to the entry of key.
+        /// </summary>
+        void Store(const std::string &key, llvm::Function *kernelFunction);
+
+    private:
+        std::string directory;
+        llvm::Module *source;
+        const ModuleIndex &index;
+        llvm::ModuleSlotTracker slots;
+        std::string GetPath(const std::string &key);
+    };
+} // namespace TraceAtlas::tik
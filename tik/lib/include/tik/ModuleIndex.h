@@ -0,0 +1,29 @@
+#pragma once
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Value.h>
+#include <vector>
+
+namespace TraceAtlas::tik
+{
+    /// <summary>
+    /// The blocks and instructions of an annotated module by ID. It is built once and shared by every kernel converted from the module.
+    /// </summary>
+    class ModuleIndex
+    {
+    public:
+        explicit ModuleIndex(llvm::Module *M);
+        /// <summary>
+        /// The block with the ID, nullptr if there is none.
+        /// </summary>
+        llvm::BasicBlock *GetBlock(int64_t id) const;
+        /// <summary>
+        /// The instruction with the value ID, nullptr if there is none.
+        /// </summary>
+        llvm::Value *GetValue(int64_t id) const;
+
+    private:
+        std::vector<llvm::BasicBlock *> blocks;
+        std::vector<llvm::Value *> values;
+    };
+} // namespace TraceAtlas::tik
@@ -13,9 +13,13 @@ namespace TraceAtlas::tik
 {
     std::string GetString(llvm::Value *v);
     std::vector<std::string> GetStrings(llvm::BasicBlock *bb);
-    std::vector<std::string> GetStrings(std::set<llvm::Instruction *> instructions);
-    std::vector<std::string> GetStrings(std::vector<llvm::Instruction *> instructions);
+    std::vector<std::string> GetStrings(const std::set<llvm::Instruction *> &instructions);
+    std::vector<std::string> GetStrings(const std::vector<llvm::Instruction *> &instructions);
     std::map<std::string, std::vector<std::string>> GetStrings(llvm::Function *f);
+    /// <summary>
+    /// Every instruction of the function in order, rendered in a single pass over it.
+    /// </summary>
+    std::vector<std::string> GetInstructionStrings(llvm::Function *f);
     std::set<llvm::BasicBlock *> GetReachable(llvm::BasicBlock *base, std::set<int64_t> validBlocks);
     bool IsSelfReachable(llvm::BasicBlock *base, const std::set<int64_t> &validBlocks);
     bool IsReachable(llvm::BasicBlock *base, llvm::BasicBlock *target, const std::set<int64_t> &validBlocks);
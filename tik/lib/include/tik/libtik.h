@@ -5,7 +5,10 @@
 
 namespace TraceAtlas::tik
 {
-    extern llvm::Module *TikModule;
-    extern std::map<llvm::Function *, std::shared_ptr<Kernel>> KfMap;
-    extern std::map<int64_t, std::shared_ptr<Kernel>> KernelMap;
+    /// <summary>
+    /// The state of the kernels being converted. Every thread converts into its own module.
+    /// </summary>
+    extern thread_local llvm::Module *TikModule;
+    extern thread_local std::map<llvm::Function *, std::shared_ptr<Kernel>> KfMap;
+    extern thread_local std::map<int64_t, std::shared_ptr<Kernel>> KernelMap;
 } // namespace TraceAtlas::tik
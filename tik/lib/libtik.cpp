@@ -3,7 +3,7 @@
 #include <memory>
 namespace TraceAtlas::tik
 {
-    llvm::Module *TikModule;
-    std::map<int64_t, std::shared_ptr<Kernel>> KernelMap;
-    std::map<llvm::Function *, std::shared_ptr<Kernel>> KfMap;
+    thread_local llvm::Module *TikModule;
+    thread_local std::map<int64_t, std::shared_ptr<Kernel>> KernelMap;
+    thread_local std::map<llvm::Function *, std::shared_ptr<Kernel>> KfMap;
 } // namespace TraceAtlas::tik
\ No newline at end of file
@@ -3,9 +3,13 @@
 #include "AtlasUtil/Print.h"
 #include "tik/CartographerKernel.h"
 #include "tik/Header.h"
+#include "tik/KernelCache.h"
+#include "tik/ModuleIndex.h"
+#include "tik/TikKernel.h"
 #include "tik/Util.h"
 #include "tik/libtik.h"
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
@@ -15,7 +19,11 @@
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker/Linker.h>
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_os_ostream.h>
 #include <llvm/Support/raw_ostream.h>
@@ -24,6 +32,7 @@
 #include <spdlog/sinks/basic_file_sink.h>
 #include <spdlog/spdlog.h>
 #include <string>
+#include <thread>
 
 using namespace std;
 using namespace llvm;
@@ -48,6 +57,178 @@ cl::opt<string> OutputType("f", cl::desc("Specify output file format. Can be LLV
 cl::opt<bool> ASCIIFormat("S", cl::desc("output json as human-readable ASCII text"));
 cl::opt<string> LogFile("l", cl::desc("Specify log filename"), cl::value_desc("log file"));
 cl::opt<int> LogLevel("v", cl::desc("Logging level"), cl::value_desc("logging level"), cl::init(4));
+cl::opt<unsigned int> Threads("T", cl::desc("Number of threads converting kernels, 0 uses every core"), cl::value_desc("threads"), cl::init(0));
+cl::opt<string> CacheDirectory("c", cl::desc("Directory of the kernel cache, kernels found in it are not converted again"), cl::value_desc("directory"));
+
+/// <summary>
+/// A thread converting a share of the kernels. Every worker but the first converts in a context and module of its own.
+/// </summary>
+struct Worker
+{
+    unique_ptr<LLVMContext> ownContext;
+    unique_ptr<Module> ownSource;
+    unique_ptr<Module> ownTik;
+    Module *source = nullptr;
+    Module *tik = nullptr;
+    vector<string> kernels;
+    uint64_t blocks = 0;
+    map<string, shared_ptr<Kernel>> converted;
+    bool error = false;
+};
+
+/// <summary>
+/// Goes through the kernels in the order they are converted in: the ready kernel with the smallest name is next.
+/// A kernel without nested kernels is ready. A kernel holding a single nested kernel is ready once that one was converted, kernels holding more are left alone.
+/// convert returns whether the kernel was converted.
+/// </summary>
+static void ScheduleKernels(const vector<string> &kernels, const map<string, vector<string>> &childParentMapping, const function<bool(const string &)> &convert)
+{
+    set<string> ready;
+    map<string, vector<string>> released;
+    for (const auto &kernel : kernels)
+    {
+        auto nested = childParentMapping.find(kernel);
+        if (nested == childParentMapping.end())
+        {
+            ready.insert(kernel);
+        }
+        else if (nested->second.size() == 1)
+        {
+            released[nested->second.front()].push_back(kernel);
+        }
+    }
+    while (!ready.empty())
+    {
+        string kernel = *ready.begin();
+        ready.erase(ready.begin());
+        if (convert(kernel))
+        {
+            for (const auto &parent : released[kernel])
+            {
+                ready.insert(parent);
+            }
+        }
+    }
+}
+
+/// <summary>
+/// Links a module of the context of TikModule into it. Globals that are in both stay a single global, the definition already in TikModule is kept.
+/// </summary>
+static void LinkModule(unique_ptr<Module> part)
+{
+    vector<pair<GlobalVariable *, GlobalValue::LinkageTypes>> localGlobals;
+    for (auto &global : part->globals())
+    {
+        GlobalVariable *existing = global.hasName() ? TikModule->getNamedGlobal(global.getName()) : nullptr;
+        if (existing == nullptr)
+        {
+            continue;
+        }
+        //local globals only resolve against each other while they are linked as external ones
+        if (existing->hasLocalLinkage())
+        {
+            localGlobals.emplace_back(existing, existing->getLinkage());
+            existing->setLinkage(GlobalValue::ExternalLinkage);
+        }
+        if (existing->hasInitializer())
+        {
+            global.setInitializer(nullptr);
+            global.setComdat(nullptr);
+        }
+        global.setLinkage(GlobalValue::ExternalLinkage);
+    }
+    if (Linker::linkModules(*TikModule, move(part)))
+    {
+        throw AtlasException("Failed to link kernels into the tik module");
+    }
+    for (auto &[global, linkage] : localGlobals)
+    {
+        global->setLinkage(linkage);
+    }
+}
+
+/// <summary>
+/// Converts the kernels of the worker in its module. Independent kernels, the ones sharing no blocks with other kernels, are looked up in the kernel cache first.
+/// </summary>
+static void ConvertKernels(Worker &worker, const map<string, vector<int64_t>> &kernels, const map<string, vector<string>> &childParentMapping, const set<string> &independent)
+{
+    set<vector<int64_t>> failedKernels;
+    ModuleIndex index(worker.source);
+    unique_ptr<KernelCache> cache;
+    if (!CacheDirectory.empty())
+    {
+        cache = make_unique<KernelCache>(CacheDirectory, worker.source, index);
+    }
+    ScheduleKernels(worker.kernels, childParentMapping, [&](const string &name) {
+        const auto &blocks = kernels.at(name);
+        if (failedKernels.find(blocks) != failedKernels.end())
+        {
+            return false;
+        }
+        string key;
+        shared_ptr<Kernel> kern;
+        if (cache && independent.find(name) != independent.end())
+        {
+            key = cache->GetKey(blocks);
+            if (auto entry = cache->Load(key, CartographerKernel::GetFunctionName(name)))
+            {
+                LinkModule(move(entry));
+                kern = make_shared<TikKernel>(TikModule->getFunction(CartographerKernel::GetFunctionName(name)));
+                reservedNames.insert(kern->Name);
+            }
+        }
+        if (kern == nullptr)
+        {
+            kern = make_shared<CartographerKernel>(blocks, index, name);
+            if (!kern->Valid)
+            {
+                failedKernels.insert(blocks);
+                worker.error = true;
+                spdlog::error("Failed to convert kernel: " + name);
+                return false;
+            }
+            if (!key.empty())
+            {
+                cache->Store(key, kern->KernelFunction);
+            }
+            spdlog::info("Successfully converted kernel: " + name);
+        }
+        else
+        {
+            spdlog::info("Loaded kernel from the cache: " + name);
+        }
+        KfMap[kern->KernelFunction] = kern;
+        for (auto block : blocks)
+        {
+            if (KernelMap.find(block) == KernelMap.end())
+            {
+                KernelMap[block] = kern;
+            }
+        }
+        worker.converted[name] = kern;
+        return true;
+    });
+}
+
+/// <summary>
+/// Links the module of a worker into TikModule. It goes through bitcode since modules of different contexts can't be linked directly.
+/// </summary>
+static void LinkWorker(Worker &worker)
+{
+    if (verifyModule(*worker.tik))
+    {
+        throw AtlasException("Tik Module Corrupted");
+    }
+    SmallVector<char, 0> buffer;
+    raw_svector_ostream stream(buffer);
+    WriteBitcodeToFile(*worker.tik, stream);
+    auto parsed = parseBitcodeFile(MemoryBufferRef(StringRef(buffer.data(), buffer.size()), worker.tik->getName()), TikModule->getContext());
+    if (!parsed)
+    {
+        throw AtlasException("Failed to load the kernels of a worker: " + toString(parsed.takeError()));
+    }
+    LinkModule(move(*parsed));
+}
 
 int main(int argc, char *argv[])
 {
@@ -182,72 +363,182 @@ int main(int argc, char *argv[])
     TikModule->setDataLayout(sourceBitcode->getDataLayout());
     TikModule->setTargetTriple(sourceBitcode->getTargetTriple());
 
-    //we now process all kernels who have no children and then remove them as we go
-    std::vector<shared_ptr<Kernel>> results;
+    //kernels that share blocks depend on each other, so they are converted by the same worker
+    vector<string> names;
+    for (const auto &kernel : kernels)
+    {
+        names.push_back(kernel.first);
+    }
+    vector<size_t> group(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        group[i] = i;
+    }
+    function<size_t(size_t)> findGroup = [&](size_t i) {
+        return group[i] == i ? i : group[i] = findGroup(group[i]);
+    };
+    map<int64_t, size_t> blockOwner;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        for (auto block : kernels[names[i]])
+        {
+            auto owner = blockOwner.find(block);
+            if (owner == blockOwner.end())
+            {
+                blockOwner[block] = i;
+            }
+            else
+            {
+                group[findGroup(i)] = findGroup(owner->second);
+            }
+        }
+    }
+    map<size_t, pair<uint64_t, vector<string>>> components;
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        auto &component = components[findGroup(i)];
+        component.first += kernels[names[i]].size();
+        component.second.push_back(names[i]);
+    }
+    set<string> independent;
+    for (const auto &component : components)
+    {
+        if (component.second.second.size() == 1)
+        {
+            independent.insert(component.second.second.front());
+        }
+    }
+    if (!CacheDirectory.empty() && sys::fs::create_directories(CacheDirectory))
+    {
+        spdlog::critical("Failed to create the kernel cache: " + CacheDirectory);
+        return EXIT_FAILURE;
+    }
 
-    bool change = true;
-    set<vector<int64_t>> failedKernels;
-    while (change)
+    //the largest components are handed out first, each to the worker with the fewest blocks so far
+    unsigned int threadCount = Threads == 0 ? thread::hardware_concurrency() : (unsigned int)Threads;
+    threadCount = (unsigned int)max((size_t)1, min((size_t)threadCount, components.size()));
+    vector<unique_ptr<Worker>> workers;
+    for (unsigned int i = 0; i < threadCount; i++)
+    {
+        workers.push_back(make_unique<Worker>());
+    }
+    vector<pair<uint64_t, vector<string>>> ordered;
+    for (auto &component : components)
+    {
+        ordered.push_back(move(component.second));
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), [](const auto &a, const auto &b) { return a.first > b.first; });
+    for (const auto &component : ordered)
+    {
+        auto worker = min_element(workers.begin(), workers.end(), [](const auto &a, const auto &b) { return a->blocks < b->blocks; });
+        (*worker)->blocks += component.first;
+        (*worker)->kernels.insert((*worker)->kernels.end(), component.second.begin(), component.second.end());
+    }
+    for (auto &worker : workers)
     {
-        change = false;
-        for (const auto &kernel : kernels)
+        std::sort(worker->kernels.begin(), worker->kernels.end());
+    }
+
+    //the first worker converts into the tik module itself, the others into modules of their own that are linked into it afterwards
+    workers[0]->source = base;
+    workers[0]->tik = TikModule;
+    SmallVector<char, 0> sourceBuffer;
+    if (workers.size() > 1)
+    {
+        raw_svector_ostream sourceStream(sourceBuffer);
+        WriteBitcodeToFile(*base, sourceStream);
+        spdlog::info("Converting " + to_string(kernels.size()) + " kernels on " + to_string(workers.size()) + " threads");
+    }
+    auto run = [&](size_t index) {
+        Worker &worker = *workers[index];
+        if (index != 0)
         {
-            if (failedKernels.find(kernel.second) != failedKernels.end())
+            worker.ownContext = make_unique<LLVMContext>();
+            auto parsed = parseBitcodeFile(MemoryBufferRef(StringRef(sourceBuffer.data(), sourceBuffer.size()), InputFile), *worker.ownContext);
+            if (!parsed)
             {
-                continue;
+                throw AtlasException("Failed to load the source bitcode on a worker: " + toString(parsed.takeError()));
             }
-            if (childParentMapping.find(kernel.first) == childParentMapping.end())
+            worker.ownSource = move(*parsed);
+            worker.ownTik = make_unique<Module>(InputFile, *worker.ownContext);
+            worker.ownTik->setDataLayout(worker.ownSource->getDataLayout());
+            worker.ownTik->setTargetTriple(worker.ownSource->getTargetTriple());
+            worker.source = worker.ownSource.get();
+            worker.tik = worker.ownTik.get();
+        }
+        TikModule = worker.tik;
+        ConvertKernels(worker, kernels, childParentMapping, independent);
+    };
+    vector<exception_ptr> failures(workers.size());
+    vector<thread> pool;
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        pool.emplace_back([&, i]() {
+            try
             {
-                //this kernel has no unexplained parents
-                auto kern = make_shared<CartographerKernel>(kernel.second, sourceBitcode.get(), kernel.first);
-                if (!kern->Valid)
-                {
-                    failedKernels.insert(kernel.second);
-                    error = true;
-                    spdlog::error("Failed to convert kernel: " + kernel.first);
-                }
-                else
+                run(i);
+            }
+            catch (...)
+            {
+                failures[i] = current_exception();
+            }
+        });
+    }
+    try
+    {
+        run(0);
+    }
+    catch (...)
+    {
+        failures[0] = current_exception();
+    }
+    for (auto &t : pool)
+    {
+        t.join();
+    }
+
+    std::vector<shared_ptr<Kernel>> results;
+    try
+    {
+        for (auto &failure : failures)
+        {
+            if (failure)
+            {
+                rethrow_exception(failure);
+            }
+        }
+        map<string, shared_ptr<Kernel>> converted;
+        for (size_t i = 0; i < workers.size(); i++)
+        {
+            if (i != 0)
+            {
+                LinkWorker(*workers[i]);
+            }
+            for (auto &[name, kern] : workers[i]->converted)
+            {
+                if (i != 0)
                 {
-                    KfMap[kern->KernelFunction] = kern;
-                    //so we remove its blocks from all parents
-                    vector<string> toRemove;
-                    for (auto child : childParentMapping)
-                    {
-                        auto loc = find(child.second.begin(), child.second.end(), kernel.first);
-                        if (loc != child.second.end())
-                        {
-                            child.second.erase(loc);
-                            if (child.second.empty())
-                            {
-                                toRemove.push_back(child.first);
-                            }
-                        }
-                    }
-                    //if necessary remove the entry from the map
-                    for (const auto &r : toRemove)
-                    {
-                        auto it = childParentMapping.find(r);
-                        childParentMapping.erase(it);
-                    }
-                    //publish our result
-                    results.push_back(kern);
-                    change = true;
-                    for (auto block : kernel.second)
-                    {
-                        if (KernelMap.find(block) == KernelMap.end())
-                        {
-                            KernelMap[block] = kern;
-                        }
-                    }
-                    //and remove it from kernels
-                    auto it = find(kernels.begin(), kernels.end(), kernel);
-                    kernels.erase(it);
-                    spdlog::info("Successfully converted kernel: " + kernel.first);
-                    //and restart the iterator to ensure cohesion
-                    break;
+                    kern->KernelFunction = TikModule->getFunction(kern->KernelFunction->getName());
                 }
+                converted[name] = kern;
             }
+            error |= workers[i]->error;
         }
+        //the kernels are listed in the order a single thread converts them in
+        ScheduleKernels(names, childParentMapping, [&](const string &name) {
+            auto kern = converted.find(name);
+            if (kern == converted.end())
+            {
+                return false;
+            }
+            results.push_back(kern->second);
+            return true;
+        });
+    }
+    catch (AtlasException &e)
+    {
+        spdlog::critical(e.what());
+        return EXIT_FAILURE;
     }
 
     // generate a C header file declaring each tik function